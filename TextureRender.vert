@@ -4,19 +4,38 @@
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 2) in vec2 vertexTexCoord;
 
-uniform mat4 MVP;
+// View * Projection, uploaded once per frame
+layout (std140) uniform Camera
+{
+    mat4 VP;
+};
+
+// One entry per drawn object : xy = translation, z = rotation (radians), w = scale
+layout (std140) uniform Transforms
+{
+    vec4 objectTransform[1024];
+};
+
+// Entry of the first object in this draw, instances follow it
+uniform int transformBase;
 
 // output data : used by fragment shader
 out vec2 fragTexCoord;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    vec4 t = objectTransform[transformBase + gl_InstanceID];
+    float c = cos(t.z);
+    float s = sin(t.z);
+
+    // Model transform : scale, rotate about z, then translate
+    vec2 p = t.w * vertexPosition.xy;
+    p = vec2(c*p.x - s*p.y, s*p.x + c*p.y) + t.xy;
 
     // The texture coord of each vertex will be interpolated
     // to produce the color of each fragment
     fragTexCoord = vertexTexCoord;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
-}
\ No newline at end of file
+    // Output position of the vertex, in clip space : VP * M * position
+    gl_Position = VP * vec4(p, vertexPosition.z, 1);
+}
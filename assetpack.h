@@ -0,0 +1,103 @@
+/* Asset pack, shared by the game and mkpack.
+
+   Every asset the game loads by name, in one file that is mapped once :
+
+     AssetPackHeader
+     AssetEntry[count]     sorted by name hash, for a binary search
+     names                 NUL terminated, to confirm a hash match
+     data                  each asset starting on an ASSET_ALIGN boundary
+
+   Names are the relative paths the game asks for ("beach.png", "texcache/beach.png.mtx"). */
+#ifndef ASSETPACK_H
+#define ASSETPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define ASSET_PACK_MAGIC 0x4b415031   // "1PAK"
+#define ASSET_PACK_VERSION 1
+#define ASSET_ALIGN 16
+#define ASSET_PACK_PATH "assets.pak"
+
+enum AssetType {
+    ASSET_RAW = 0,
+    ASSET_SHADER = 1,
+    ASSET_IMAGE = 2,
+    ASSET_FONT = 3,
+    ASSET_TEXTURE_CACHE = 4,
+    ASSET_LEVEL = 5
+};
+
+struct AssetPackHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t namesSize;
+    uint64_t namesOffset;
+};
+
+struct AssetEntry {
+    uint64_t hash;        // assetHash of the name
+    uint64_t offset;      // from the start of the pack
+    uint64_t size;
+    uint32_t nameOffset;  // into the name table
+    uint32_t type;
+    uint32_t checksum;    // assetChecksum of the data
+    uint32_t reserved;
+};
+
+/* FNV-1a, 64 bit */
+inline uint64_t assetHash (const char* name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* CRC-32 (IEEE). The table is a local static, so it is built once even with several threads asking */
+struct AssetCrcTable {
+    uint32_t entries[256];
+    AssetCrcTable () {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+    }
+};
+
+inline uint32_t assetChecksum (const void* data, size_t size)
+{
+    static const AssetCrcTable table;
+    uint32_t crc = 0xffffffff;
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++)
+        crc = table.entries[(crc ^ bytes[i]) & 255] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+/* Type from the file name, only used for listings and sanity checks */
+inline uint32_t assetTypeOf (const char* name)
+{
+    const char* dot = strrchr(name, '.');
+    if (!dot)
+        return ASSET_RAW;
+    if (!strcmp(dot, ".vert") || !strcmp(dot, ".frag") || !strcmp(dot, ".glsl"))
+        return ASSET_SHADER;
+    if (!strcmp(dot, ".png") || !strcmp(dot, ".jpg") || !strcmp(dot, ".bmp") || !strcmp(dot, ".tga"))
+        return ASSET_IMAGE;
+    if (!strcmp(dot, ".ttf") || !strcmp(dot, ".otf"))
+        return ASSET_FONT;
+    if (!strcmp(dot, ".mtx"))
+        return ASSET_TEXTURE_CACHE;
+    if (!strcmp(dot, ".lvl"))
+        return ASSET_LEVEL;
+    return ASSET_RAW;
+}
+
+#endif
@@ -1,14 +1,20 @@
 #version 330 core
 
 // Interpolated values from the vertex shaders
-in vec3 fragColor;
+in vec2 fragTexCoord;
+in vec4 fragColor;
 
 // output data
-out vec3 color;
+out vec4 color;
+
+// Signed distance field of the glyphs : 0.5 on the outline, more inside
+uniform sampler2D glyphAtlas;
 
 void main()
 {
-    // Output color = color specified in the vertex shader,
-    // interpolated between all 3 surrounding vertices of the triangle
-    color = fragColor;
-}
\ No newline at end of file
+    // Antialias over about one screen pixel, whatever size the text is drawn at
+    float distance = texture( glyphAtlas, fragTexCoord ).r;
+    float width = fwidth( distance );
+    float coverage = smoothstep( 0.5 - width, 0.5 + width, distance );
+    color = vec4( fragColor.rgb, fragColor.a * coverage );
+}
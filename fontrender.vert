@@ -1,17 +1,23 @@
 #version 330 core
 
-uniform mat4 MVP;
-uniform vec3 pen;
-uniform vec3 fontColor;
+// input data : glyph quads, already laid out in world space
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec4 vertexColor;
+layout (location = 2) in vec2 vertexTexCoord;
 
-in vec3 vertexPosition;
-in vec3 vertexNormal;
+// View * Projection, uploaded once per frame
+layout (std140) uniform Camera
+{
+    mat4 VP;
+};
 
-out vec3 fragColor;
+// output data : used by fragment shader
+out vec2 fragTexCoord;
+out vec4 fragColor;
 
 void main ()
 {
-    gl_Position = MVP * (vec4(vertexPosition, 1.0) + vec4(pen, 1.0));
-    // fragColor = vec3((vertexNormal.x+1)/2,(vertexNormal.y+1)/2,(vertexNormal.z+1)/2);
-    fragColor = fontColor;
-}
\ No newline at end of file
+    fragTexCoord = vertexTexCoord;
+    fragColor = vertexColor;
+    gl_Position = VP * vec4(vertexPosition, 0, 1);
+}
@@ -1,11 +1,33 @@
 #include <iostream>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <chrono>
+#include <type_traits>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
-#include <FTGL/ftgl.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
 #include <SOIL/SOIL.h>
 //#include <SOIL.h>
 
@@ -14,42 +36,421 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "texcache.h"
+#include "assetpack.h"
+#include "level.h"
+#include "physics.h"
+
 using namespace std;
 
-double projectile_x_coordinate=-3,projectile_y_coordinate=-2,projectile_velocity=0,projectile_angle=0;
-double projectile_x_velocity=0,projectile_y_velocity=0;
-double air_resistance=0.998,gravity=0.02,bounce=0.7;
+// Aim : launch speed and barrel angle (degrees). The shot itself is the Projectile entity
+double projectile_velocity=0,projectile_angle=0;
+// Physics parameters to tune with, given as "air_resistance gravity bounce" in PHYSICS_TUNING
+RuntimePhysics physics_tuning;
+bool physics_tuned=false;
 int flag=0;
 
 float ortho_x_max=4.0f,ortho_x_min=-4.0f;
 float ortho_y_max = 4.0f,ortho_y_min=-4.0f;
 
-double level=1.0,score=0;
+double level=1.0;
+
+
+/**************************
+ * Arenas                 *
+ **************************/
+
+/* Bump allocators. An allocation moves a pointer, and a reset rewinds the arena in one step
+   instead of freeing object by object. Blocks are kept across resets, so a restarted level
+   reuses the memory of the last one. Nothing allocated here has its destructor run */
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+struct ArenaBlock {
+    unsigned char* start;
+    size_t size;
+};
+
+struct Arena {
+    vector<ArenaBlock> blocks;
+    size_t current;               // block being filled
+    unsigned char *next, *end;
+};
+
+// Engine objects that live as long as the program, and everything spawned for the current level
+Arena EngineArena, LevelArena;
+
+/* Continue in the next kept block big enough for 'size', or a new one */
+void arenaGrow (Arena& arena, size_t size)
+{
+    size_t block = arena.next ? arena.current + 1 : 0;
+    while (block < arena.blocks.size() && arena.blocks[block].size < size)
+        block++;
+    if (block == arena.blocks.size()) {
+        ArenaBlock fresh = { NULL, max((size_t) ARENA_BLOCK_SIZE, size) };
+        fresh.start = (unsigned char*) malloc (fresh.size);
+        if (!fresh.start) {
+            fprintf (stderr, "Out of memory for a %zu byte arena block\n", fresh.size);
+            exit (EXIT_FAILURE);
+        }
+        arena.blocks.push_back (fresh);
+    }
+    arena.current = block;
+    arena.next = arena.blocks[block].start;
+    arena.end = arena.next + arena.blocks[block].size;
+}
+
+void* arenaAlloc (Arena& arena, size_t size, size_t align = 16)
+{
+    uintptr_t at = ((uintptr_t) arena.next + align - 1) & ~(uintptr_t) (align - 1);
+    if (!arena.next || at + size > (uintptr_t) arena.end) {
+        arenaGrow (arena, size + align);
+        at = ((uintptr_t) arena.next + align - 1) & ~(uintptr_t) (align - 1);
+    }
+    arena.next = (unsigned char*) (at + size);
+    return (void*) at;
+}
+
+void arenaReset (Arena& arena)
+{
+    arena.next = arena.end = NULL;
+    arena.current = 0;
+}
+
+template <typename T>
+T* arenaNew (Arena& arena)
+{
+    return new (arenaAlloc(arena, sizeof(T), alignof(T))) T();
+}
+
+/* Standard containers on the level arena. Freeing is a no-op, the level reset takes it all */
+template <typename T>
+struct LevelAllocator {
+    typedef T value_type;
+    LevelAllocator () {}
+    template <typename U> LevelAllocator (const LevelAllocator<U>&) {}
+    T* allocate (size_t n) { return (T*) arenaAlloc(LevelArena, n * sizeof(T), alignof(T)); }
+    void deallocate (T*, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator== (const LevelAllocator<T>&, const LevelAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!= (const LevelAllocator<T>&, const LevelAllocator<U>&) { return false; }
+
+template <typename T>
+using LevelVector = vector<T, LevelAllocator<T> >;
+
+/* Start a container on the level arena over, empty. Its old contents aren't destroyed one
+   by one, they go with the arena */
+template <typename T>
+void arenaForget (T& object)
+{
+    new (&object) T();
+}
+
+
+/**************************
+ * Entities               *
+ **************************/
+
+/* Everything that moves, collides, scores or is drawn per frame is an entity. Entities with
+   the same set of components share an archetype, which keeps each component in its own packed
+   column, and systems walk the columns of every archetype that has what they need */
+enum ComponentBits {
+    HAS_TRANSFORM = 1 << 0,
+    HAS_VELOCITY = 1 << 1,
+    HAS_COLLIDER = 1 << 2,
+    HAS_RENDERABLE = 1 << 3,
+    HAS_SCORE = 1 << 4
+};
+
+struct Transform {
+    float x, y;
+    float angle;          // degrees
+};
+
+struct Velocity {
+    float x, y;           // units per second
+    float wrapLeft, wrapRight;   // if wrapRight > wrapLeft, passing wrapRight brings it back at wrapLeft
+};
+
+enum ColliderShape { COLLIDE_CIRCLE, COLLIDE_BOX };
+
+struct Collider {
+    int shape;
+    float radius;                     // COLLIDE_CIRCLE
+    float left, bottom, right, top;   // COLLIDE_BOX, relative to the transform
+    bool hit;                         // touched by the projectile at some point
+    bool bounced;                     // the projectile has already bounced off it
+};
+
+struct VAO;
+struct ShaderProgram;
+
+struct Renderable {
+    struct VAO* (*mesh) ();           // built on first use
+    struct ShaderProgram** shader;    // the program handle, which survives hot reloads
+    int layer;                        // RenderLayer
+};
+
+struct ScoreValue {
+    int points;                       // added to the score while the collider is hit
+};
+
+typedef int Entity;
+
+struct Archetype {
+    unsigned mask;
+    LevelVector<Entity> entities;
+    // Only the columns in 'mask' are used, row i of each belongs to entities[i]
+    LevelVector<Transform> transforms;
+    LevelVector<Velocity> velocities;
+    LevelVector<Collider> colliders;
+    LevelVector<Renderable> renderables;
+    LevelVector<ScoreValue> scores;
+};
+
+struct EntityRecord {
+    int archetype;
+    int row;
+};
+
+// Every column is on the level arena
+struct EntityWorld {
+    LevelVector<Archetype> archetypes;
+    LevelVector<EntityRecord> entities;
+    LevelVector<Entity> freeIds;      // of despawned entities, reused first
+} World;
+
+// Moves on whenever an entity is spawned or despawned, in this level or any other
+uint64_t world_generation = 0;
+
+Archetype& archetypeFor (unsigned mask)
+{
+    for (size_t i = 0; i < World.archetypes.size(); i++)
+        if (World.archetypes[i].mask == mask)
+            return World.archetypes[i];
+    World.archetypes.push_back (Archetype());
+    World.archetypes.back().mask = mask;
+    return World.archetypes.back();
+}
+
+/* New entity with zeroed components, fill them in through the *Of accessors */
+Entity spawnEntity (unsigned mask)
+{
+    world_generation++;
+    Archetype& archetype = archetypeFor (mask);
+    EntityRecord record = { (int) (&archetype - &World.archetypes[0]), (int) archetype.entities.size() };
+    Entity entity;
+    if (World.freeIds.empty()) {
+        entity = World.entities.size();
+        World.entities.push_back (record);
+    }
+    else {
+        entity = World.freeIds.back();
+        World.freeIds.pop_back();
+        World.entities[entity] = record;
+    }
+
+    archetype.entities.push_back (entity);
+    if (mask & HAS_TRANSFORM)
+        archetype.transforms.push_back (Transform());
+    if (mask & HAS_VELOCITY)
+        archetype.velocities.push_back (Velocity());
+    if (mask & HAS_COLLIDER)
+        archetype.colliders.push_back (Collider());
+    if (mask & HAS_RENDERABLE)
+        archetype.renderables.push_back (Renderable());
+    if (mask & HAS_SCORE)
+        archetype.scores.push_back (ScoreValue());
+    return entity;
+}
+
+template <typename T>
+void removeRow (LevelVector<T>& column, int row)
+{
+    column[row] = column.back();
+    column.pop_back();
+}
+
+/* The entity's row goes, the last row of its archetype moves into the gap */
+void despawnEntity (Entity entity)
+{
+    world_generation++;
+    EntityRecord record = World.entities[entity];
+    Archetype& archetype = World.archetypes[record.archetype];
+    Entity moved = archetype.entities.back();
+    removeRow (archetype.entities, record.row);
+    if (archetype.mask & HAS_TRANSFORM)
+        removeRow (archetype.transforms, record.row);
+    if (archetype.mask & HAS_VELOCITY)
+        removeRow (archetype.velocities, record.row);
+    if (archetype.mask & HAS_COLLIDER)
+        removeRow (archetype.colliders, record.row);
+    if (archetype.mask & HAS_RENDERABLE)
+        removeRow (archetype.renderables, record.row);
+    if (archetype.mask & HAS_SCORE)
+        removeRow (archetype.scores, record.row);
+    World.entities[moved].row = record.row;
+    World.entities[entity].archetype = -1;
+    World.freeIds.push_back (entity);
+}
+
+/* Room for 'count' more entities of 'mask', so spawning a level grows each column once */
+void reserveEntities (unsigned mask, size_t count)
+{
+    Archetype& archetype = archetypeFor (mask);
+    size_t rows = archetype.entities.size() + count;
+    if (count > World.freeIds.size())
+        World.entities.reserve (World.entities.size() + count - World.freeIds.size());
+    archetype.entities.reserve (rows);
+    if (mask & HAS_TRANSFORM)
+        archetype.transforms.reserve (rows);
+    if (mask & HAS_VELOCITY)
+        archetype.velocities.reserve (rows);
+    if (mask & HAS_COLLIDER)
+        archetype.colliders.reserve (rows);
+    if (mask & HAS_RENDERABLE)
+        archetype.renderables.reserve (rows);
+    if (mask & HAS_SCORE)
+        archetype.scores.reserve (rows);
+}
+
+Transform& transformOf (Entity e)
+{
+    EntityRecord& r = World.entities[e];
+    return World.archetypes[r.archetype].transforms[r.row];
+}
+
+Velocity& velocityOf (Entity e)
+{
+    EntityRecord& r = World.entities[e];
+    return World.archetypes[r.archetype].velocities[r.row];
+}
+
+Collider& colliderOf (Entity e)
+{
+    EntityRecord& r = World.entities[e];
+    return World.archetypes[r.archetype].colliders[r.row];
+}
+
+Renderable& renderableOf (Entity e)
+{
+    EntityRecord& r = World.entities[e];
+    return World.archetypes[r.archetype].renderables[r.row];
+}
+
+ScoreValue& scoreOf (Entity e)
+{
+    EntityRecord& r = World.entities[e];
+    return World.archetypes[r.archetype].scores[r.row];
+}
+
+/* Calls 'system' once per archetype that has every component in 'required' */
+void forEachArchetype (unsigned required, const function<void(Archetype&)>& system)
+{
+    for (size_t i = 0; i < World.archetypes.size(); i++)
+        if ((World.archetypes[i].mask & required) == required && !World.archetypes[i].entities.empty())
+            system (World.archetypes[i]);
+}
+
+// The player's shot and the cannon barrel that aims it
+Entity Projectile = -1, Barrel = -1;
+
+
+/**************************
+ * Startup timeline       *
+ **************************/
+
+/* Wall time of every startup step, printed once the first frame is on screen. Steps nest, so
+   initGL shows up with the create* calls it made underneath it */
+struct StartupEvent {
+    const char* name;
+    double start, duration;   // seconds from the start of main
+    int depth;
+};
 
+struct StartupTimeline {
+    vector<StartupEvent> events;
+    double origin;
+    int depth;
+    bool reported;
+} Startup;
 
-typedef struct object
+double startupClock ()
 {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Times the enclosing scope as one step. Does nothing once the timeline has been reported */
+struct StartupStep {
+    int index;
+
+    StartupStep (const char* name) : index(-1) {
+        if (Startup.reported)
+            return;
+        StartupEvent event = { name, startupClock() - Startup.origin, 0, Startup.depth++ };
+        index = Startup.events.size();
+        Startup.events.push_back(event);
+    }
+    ~StartupStep () {
+        if (index < 0)
+            return;
+        Startup.events[index].duration = startupClock() - Startup.origin - Startup.events[index].start;
+        Startup.depth--;
+    }
+};
 
-  int collided;
-  int obj_num;
-  double radius,x_coordinate,y_coordinate,z_coordinate;
-  double x_velocity,y_velocity;
+/* Call after the first swap : prints the timeline and the time to first frame */
+void reportStartup ()
+{
+    if (Startup.reported)
+        return;
+    Startup.reported = true;
+
+    printf("Startup timeline (ms from start)\n");
+    for (size_t i = 0; i < Startup.events.size(); i++) {
+        const StartupEvent& event = Startup.events[i];
+        printf("  %8.2f %8.2f  %*s%s\n", event.start*1000, event.duration*1000, 2*event.depth, "", event.name);
+    }
+    printf("Time to first frame: %.2f ms\n", (startupClock() - Startup.origin)*1000);
+}
 
-}object;
+/* Textures are used through this handle, so the loader can replace the placeholder with the
+   real image once it has been decoded and uploaded */
+struct Texture {
+    GLuint TextureID;
+    int Width, Height;
+    bool Loaded;
+
+    // Sprites packed into an atlas : where the image sits, as u/v offset and scale
+    bool InAtlas;
+    GLfloat AtlasRect[4];
+    // VAOs created before the atlas was packed, with their original texture coords
+    vector<pair<struct VAO*, vector<GLfloat> > > PendingUVs;
+};
 
-object array_collisions[100];   
+/* Texture coords of a sprite mapped into its atlas rectangle */
+void remapTexCoords (const struct Texture* image, int numVertices, const GLfloat* in, GLfloat* out)
+{
+    for (int i=0; i<numVertices; i++) {
+        out[2*i] = image->AtlasRect[0] + in[2*i] * image->AtlasRect[2];
+        out[2*i + 1] = image->AtlasRect[1] + in[2*i + 1] * image->AtlasRect[3];
+    }
+}
 
 struct VAO {
     GLuint VertexArrayID;
     GLuint VertexBuffer;
     GLuint ColorBuffer;
     GLuint TextureBuffer;
-    GLuint TextureID;
+    struct Texture* Image;   // NULL for untextured objects
 
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    float Radius;   // of a circle around the model origin enclosing every vertex, for culling
 };
 typedef struct VAO VAO;
 
@@ -57,294 +458,2172 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
+	GLint TransformBaseID;
+	GLint TextureTransformBaseID;
 } Matrices;
 
-struct FTGLFont {
-  FTFont* font;
-  GLuint fontMatrixID;
-  GLuint fontColorID;
-} GL3Font;
-
 GLuint programID, fontProgramID, textureProgramID;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
-
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
-	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
-	}
+/* Shadow copy of the GL binding state, so draws only touch GL when something changed */
+#define MAX_TEXTURE_UNITS 8
+#define GL_STATE_UNKNOWN ((GLuint) -1)
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
-	}
+struct GLStateCache {
+    GLuint program;
+    GLuint vertexArray;
+    GLuint activeTextureUnit;
+    GLuint textures[MAX_TEXTURE_UNITS];
+    GLenum polygonMode;
 
-	GLint Result = GL_FALSE;
-	int InfoLogLength;
-
-	// Compile Vertex Shader
-	printf("Compiling shader : %s\n", vertex_file_path);
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
-
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-	// Compile Fragment Shader
-	printf("Compiling shader : %s\n", fragment_file_path);
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
-
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
-
-	// Link the program
-	fprintf(stdout, "Linking program\n");
-	GLuint ProgramID = glCreateProgram();
-	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
-	glLinkProgram(ProgramID);
-
-	// Check the program
-	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
-
-	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
-
-	return ProgramID;
+    // Per-frame counters: calls sent to the driver vs calls skipped as redundant
+    int issued;
+    int elided;
+} GLState;
+
+/* Forget everything we think is bound - use after code that bypasses the cache */
+void stateInvalidate ()
+{
+    GLState.program = GL_STATE_UNKNOWN;
+    GLState.vertexArray = GL_STATE_UNKNOWN;
+    GLState.activeTextureUnit = GL_STATE_UNKNOWN;
+    for (int i=0; i<MAX_TEXTURE_UNITS; i++)
+        GLState.textures[i] = GL_STATE_UNKNOWN;
+    GLState.polygonMode = GL_STATE_UNKNOWN;
 }
 
-static void error_callback(int error, const char* description)
+void stateResetCounters ()
 {
-    fprintf(stderr, "Error: %s\n", description);
+    GLState.issued = 0;
+    GLState.elided = 0;
 }
 
-void quit(GLFWwindow *window)
+void stateUseProgram (GLuint program)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
-    exit(EXIT_SUCCESS);
+    if (GLState.program == program) {
+        GLState.elided++;
+        return;
+    }
+    glUseProgram (program);
+    GLState.program = program;
+    GLState.issued++;
 }
 
-glm::vec3 getRGBfromHue (int hue)
+void stateBindVertexArray (GLuint vertexArray)
 {
-  float intp;
-  float fracp = modff(hue/60.0, &intp);
-  float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
+    if (GLState.vertexArray == vertexArray) {
+        GLState.elided++;
+        return;
+    }
+    glBindVertexArray (vertexArray);
+    GLState.vertexArray = vertexArray;
+    GLState.issued++;
+}
 
-  if (hue < 60)
-    return glm::vec3(1,x,0);
-  else if (hue < 120)
-    return glm::vec3(x,1,0);
-  else if (hue < 180)
-    return glm::vec3(0,1,x);
-  else if (hue < 240)
-    return glm::vec3(0,x,1);
-  else if (hue < 300)
-    return glm::vec3(x,0,1);
-  else
-    return glm::vec3(1,0,x);
+void stateBindTexture (GLuint unit, GLuint texture)
+{
+    if (GLState.textures[unit] == texture) {
+        GLState.elided++;
+        return;
+    }
+    if (GLState.activeTextureUnit != unit) {
+        glActiveTexture (GL_TEXTURE0 + unit);
+        GLState.activeTextureUnit = unit;
+        GLState.issued++;
+    }
+    glBindTexture (GL_TEXTURE_2D, texture);
+    GLState.textures[unit] = texture;
+    GLState.issued++;
 }
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+
+void statePolygonMode (GLenum mode)
 {
-    struct VAO* vao = new struct VAO;
-    vao->PrimitiveMode = primitive_mode;
-    vao->NumVertices = numVertices;
-    vao->FillMode = fill_mode;
+    if (GLState.polygonMode == mode) {
+        GLState.elided++;
+        return;
+    }
+    glPolygonMode (GL_FRONT_AND_BACK, mode);
+    GLState.polygonMode = mode;
+    GLState.issued++;
+}
 
-    // Create Vertex Array Object
-    // Should be done after CreateWindow and before any other GL calls
-    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+/* Program binary cache : linked programs are saved with glGetProgramBinary and reloaded on the
+   next start, keyed by the shader sources and the driver, so a driver update just misses */
+#define PROGRAM_CACHE_DIR "shadercache"
+#define PROGRAM_CACHE_MAGIC 0x4e494250 // "PBIN"
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-    glVertexAttribPointer(
-                          0,                  // attribute 0. Vertices
-                          3,                  // size (x,y,z)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
+struct ProgramCacheHeader {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t length;
+};
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-    glVertexAttribPointer(
-                          1,                  // attribute 1. Color
-                          3,                  // size (r,g,b)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
+/* 64-bit FNV-1a, chained through 'hash' */
+uint64_t hashBytes (const void* data, size_t size, uint64_t hash=14695981039346656037ULL)
+{
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-    return vao;
+uint64_t hashString (const char* text, uint64_t hash)
+{
+    // Keep the terminator so "ab"+"c" and "a"+"bc" differ
+    return text ? hashBytes(text, strlen(text) + 1, hash) : hash;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+bool programCacheSupported ()
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-    for (int i=0; i<numVertices; i++) {
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
-    }
+    if (!GLAD_GL_ARB_get_program_binary)
+        return false;
+    GLint formats = 0;
+    glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+string programCachePath (const std::string& vertexCode, const std::string& fragmentCode)
+{
+    uint64_t hash = hashString(vertexCode.c_str(), 14695981039346656037ULL);
+    hash = hashString(fragmentCode.c_str(), hash);
+    hash = hashString((const char*) glGetString(GL_VENDOR), hash);
+    hash = hashString((const char*) glGetString(GL_RENDERER), hash);
+    hash = hashString((const char*) glGetString(GL_VERSION), hash);
+
+    char name[64];
+    snprintf (name, sizeof(name), PROGRAM_CACHE_DIR "/%016llx.bin", (unsigned long long) hash);
+    return name;
 }
 
-struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, GLuint textureID, GLenum fill_mode=GL_FILL)
+/* Returns a linked program from the cache, or 0 on a miss or if the driver rejects the binary */
+GLuint loadCachedProgram (const std::string& path)
 {
-  struct VAO* vao = new struct VAO;
-  vao->PrimitiveMode = primitive_mode;
-  vao->NumVertices = numVertices;
-  vao->FillMode = fill_mode;
-  vao->TextureID = textureID;
+    FILE* file = fopen (path.c_str(), "rb");
+    if (!file)
+        return 0;
+
+    ProgramCacheHeader header;
+    std::vector<char> binary;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == PROGRAM_CACHE_MAGIC && header.length > 0;
+    if (ok) {
+        binary.resize (header.length);
+        ok = fread(&binary[0], 1, header.length, file) == header.length;
+    }
+    fclose (file);
+    if (!ok)
+        return 0;
+
+    GLuint ProgramID = glCreateProgram();
+    glProgramBinary (ProgramID, header.format, &binary[0], header.length);
+
+    GLint Result = GL_FALSE;
+    glGetProgramiv (ProgramID, GL_LINK_STATUS, &Result);
+    if (Result != GL_TRUE) {
+        glDeleteProgram (ProgramID);
+        return 0;
+    }
+    return ProgramID;
+}
 
-  // Create Vertex Array Object
-  // Should be done after CreateWindow and before any other GL calls
-  glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-  glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-  glGenBuffers (1, &(vao->TextureBuffer));  // VBO - textures
+void saveCachedProgram (const std::string& path, GLuint ProgramID)
+{
+    GLint length = 0;
+    glGetProgramiv (ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary (ProgramID, length, NULL, &format, &binary[0]);
+
+    mkdir (PROGRAM_CACHE_DIR, 0755);
+    FILE* file = fopen (path.c_str(), "wb");
+    if (!file)
+        return;
+    ProgramCacheHeader header = { PROGRAM_CACHE_MAGIC, format, (uint32_t) length };
+    fwrite (&header, sizeof(header), 1, file);
+    fwrite (&binary[0], 1, length, file);
+    fclose (file);
+}
 
-  glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-  glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-  glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-  glVertexAttribPointer(
-              0,                  // attribute 0. Vertices
-              3,                  // size (x,y,z)
-              GL_FLOAT,           // type
-              GL_FALSE,           // normalized?
-              0,                  // stride
-              (void*)0            // array buffer offset
-              );
+/**************************
+ * Shader programs        *
+ **************************/
 
-  glBindBuffer (GL_ARRAY_BUFFER, vao->TextureBuffer); // Bind the VBO textures
-  glBufferData (GL_ARRAY_BUFFER, 2*numVertices*sizeof(GLfloat), texture_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-  glVertexAttribPointer(
-              2,                  // attribute 2. Textures
-              2,                  // size (s,t)
-              GL_FLOAT,           // type
-              GL_FALSE,           // normalized?
-              0,                  // stride
-              (void*)0            // array buffer offset
-              );
+/* Programs are described first and then built together : every shader is handed to the driver
+   before any status is queried, so drivers with parallel compile work on all of them at once */
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1 // same value as GL_COMPLETION_STATUS_ARB
+#endif
+#define MAX_INCLUDE_DEPTH 16
+
+typedef void (APIENTRYP MaxShaderCompilerThreadsProc) (GLuint count);
+
+struct ShaderProgram {
+    const char* vertexPath;
+    const char* fragmentPath;
+    std::string defines;          // permutation, e.g. "#define TEXTURED 1\n"
+    GLuint id;
+
+    // Build state
+    std::string vertexCode, fragmentCode;  // with includes and defines expanded
+    std::vector<std::string> files;        // every file the sources were read from
+    std::string cachePath;
+    GLuint vertexShader, fragmentShader;
+    bool fromCache;
+};
 
-  return vao;
-}
+ShaderProgram *ColourShader, *TextureShader, *TextShader;
 
+/**************************
+ * Asset pack             *
+ **************************/
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* assets.pak (built by mkpack) is mapped once at startup and lookups hand out pointers into
+   the mapping. Without a pack every asset is read from its loose file as before.
+   Checksums are left to `mkpack -l`, so an asset's pages are only faulted in as it is read.
+   Built with -DASSET_PACK_VERIFY, each asset is checked the first time it is looked up */
+enum AssetCheck { ASSET_UNCHECKED, ASSET_INTACT, ASSET_DAMAGED };
+
+struct AssetPack {
+    const unsigned char* data;
+    size_t size;
+    const AssetEntry* entries;   // sorted by hash
+    const char* names;
+    uint32_t count;
+    std::atomic<uint8_t>* checked;   // AssetCheck per entry, ASSET_PACK_VERIFY builds only
+} Assets;
+
+bool openAssetPack (const char* path)
 {
-    // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    int fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(AssetPackHeader)) {
+        close (fd);
+        return false;
+    }
+    void* data = mmap (NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    // Only the index is checked here
+    const AssetPackHeader* header = (const AssetPackHeader*) data;
+    bool valid = header->magic == ASSET_PACK_MAGIC && header->version == ASSET_PACK_VERSION
+              && sizeof(AssetPackHeader) + (uint64_t) header->count * sizeof(AssetEntry) <= header->namesOffset
+              && header->namesOffset + header->namesSize <= (uint64_t) info.st_size
+              && (header->namesSize == 0 || ((const char*) data)[header->namesOffset + header->namesSize - 1] == 0);
+    const AssetEntry* entries = (const AssetEntry*) (header + 1);
+    for (uint32_t i = 0; valid && i < header->count; i++)
+        valid = entries[i].offset + entries[i].size <= (uint64_t) info.st_size && entries[i].nameOffset < header->namesSize;
+    if (!valid) {
+        fprintf(stderr, "%s is not a usable asset pack, using loose files\n", path);
+        munmap (data, info.st_size);
+        return false;
+    }
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    Assets.data = (const unsigned char*) data;
+    Assets.size = info.st_size;
+    Assets.entries = entries;
+    Assets.names = (const char*) data + header->namesOffset;
+    Assets.count = header->count;
+#ifdef ASSET_PACK_VERIFY
+    Assets.checked = new std::atomic<uint8_t>[Assets.count]();
+#endif
+    printf("Assets from %s: %u files\n", path, Assets.count);
+    return true;
+}
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+bool entryBefore (const AssetEntry& entry, uint64_t hash)
+{
+    return entry.hash < hash;
+}
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+#ifdef ASSET_PACK_VERIFY
+/* Checksum of the entry, worked out once. Two threads may both work it out, to the same answer */
+bool assetIntact (const char* name, const AssetEntry* entry)
+{
+    std::atomic<uint8_t>& checked = Assets.checked[entry - Assets.entries];
+    if (checked.load() == ASSET_UNCHECKED) {
+        bool intact = assetChecksum(Assets.data + entry->offset, entry->size) == entry->checksum;
+        if (!intact)
+            fprintf(stderr, "%s is damaged in the asset pack\n", name);
+        checked.store(intact ? ASSET_INTACT : ASSET_DAMAGED);
+    }
+    return checked.load() == ASSET_INTACT;
+}
+#endif
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+/* Where a packed asset sits in the mapping. False without a pack, or when the pack doesn't
+   have it (or, verifying, has it damaged), and the caller falls back to the loose file */
+bool findAsset (const char* name, const unsigned char*& data, size_t& size)
+{
+    if (!Assets.data)
+        return false;
+    uint64_t hash = assetHash(name);
+    const AssetEntry* entry = lower_bound (Assets.entries, Assets.entries + Assets.count, hash, entryBefore);
+    if (entry == Assets.entries + Assets.count || entry->hash != hash || strcmp(Assets.names + entry->nameOffset, name) != 0)
+        return false;
+
+#ifdef ASSET_PACK_VERIFY
+    if (!assetIntact(name, entry))
+        return false;
+#endif
+    data = Assets.data + entry->offset;
+    size = entry->size;
+    return true;
 }
 
-void draw3DTexturedObject (struct VAO* vao)
+/* Size and version stamp of an asset, for caches derived from it : the checksum when it
+   comes from the pack, the modification time for a loose file */
+bool assetStamp (const char* name, uint64_t& size, uint64_t& stamp)
 {
-  // Change the Fill Mode for this object
-  glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    if (Assets.data) {
+        uint64_t hash = assetHash(name);
+        const AssetEntry* entry = lower_bound (Assets.entries, Assets.entries + Assets.count, hash, entryBefore);
+        if (entry != Assets.entries + Assets.count && entry->hash == hash && strcmp(Assets.names + entry->nameOffset, name) == 0) {
+            size = entry->size;
+            stamp = entry->checksum;
+            return true;
+        }
+    }
+    struct stat info;
+    if (stat(name, &info) != 0)
+        return false;
+    size = info.st_size;
+    stamp = info.st_mtime;
+    return true;
+}
 
-  // Bind the VAO to use
-  glBindVertexArray (vao->VertexArrayID);
+/* Whole file into 'contents' with a single read, or a copy out of the asset pack */
+bool readFile (const char* path, std::string& contents)
+{
+    const unsigned char* packed;
+    size_t packedSize;
+    if (findAsset(path, packed, packedSize)) {
+        contents.assign ((const char*) packed, packedSize);
+        return true;
+    }
 
-  // Enable Vertex Attribute 0 - 3d Vertices
-  glEnableVertexAttribArray(0);
-  // Bind the VBO to use
-  glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    int fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok) {
+        contents.resize (info.st_size);
+        size_t done = 0;
+        while (ok && done < contents.size()) {
+            ssize_t got = read (fd, &contents[done], contents.size() - done);
+            ok = got > 0;
+            done += ok ? got : 0;
+        }
+    }
+    close (fd);
+    return ok;
+}
+
+/**************************
+ * Levels                 *
+ **************************/
+
+/* A level is mapped from its compiled .lvl (see level.h and mklevel), from the asset pack or
+   the loose file. Without an up to date .lvl the text is compiled here, which is slower */
+#define LEVEL_NAME "levels/level1"
+
+struct LoadedLevel {
+    LevelHeader header;                   // fixed up, the arrays point into the data below
+    const unsigned char* data;
+    size_t mapped;                        // bytes to munmap, 0 when the data isn't a mapping
+    std::vector<unsigned char> compiled;  // compiled from the text at load
+} Level;
+
+void unloadLevel ()
+{
+    if (Level.mapped)
+        munmap ((void*) Level.data, Level.mapped);
+    Level.data = NULL;
+    Level.mapped = 0;
+    Level.compiled.clear();
+}
+
+/* The compiled level beside the text, unless the text has been edited since */
+bool mapCompiledLevel (const std::string& name)
+{
+    std::string path = name + ".lvl", source = name + ".txt";
+    struct stat text, compiled;
+    int fd = open (path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &compiled) != 0 || compiled.st_size == 0
+        || (stat(source.c_str(), &text) == 0 && text.st_mtime > compiled.st_mtime)) {
+        close (fd);
+        return false;
+    }
+    void* map = mmap (NULL, compiled.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+        return false;
+    Level.data = (const unsigned char*) map;
+    Level.mapped = compiled.st_size;
+    return true;
+}
+
+/* 'name' is without extension, "levels/level1" */
+bool loadLevel (const char* name)
+{
+    StartupStep step ("loadLevel");
+    unloadLevel();
+    std::string base = name;
+    size_t size;
+
+    // Levels in the asset pack are always compiled ones
+    bool compiled = findAsset((base + ".lvl").c_str(), Level.data, size);
+    if (!compiled && mapCompiledLevel(base)) {
+        compiled = true;
+        size = Level.mapped;
+    }
+    if (!compiled) {
+        std::string text, error;
+        if (!readFile((base + ".txt").c_str(), text)) {
+            fprintf (stderr, "No level %s.lvl or %s.txt\n", name, name);
+            return false;
+        }
+        if (!compileLevel(text.data(), text.size(), Level.compiled, error)) {
+            fprintf (stderr, "%s.txt %s\n", name, error.c_str());
+            return false;
+        }
+        printf ("%s.lvl is missing or stale, compiled %s.txt instead (make levels)\n", name, name);
+        Level.data = &Level.compiled[0];
+        size = Level.compiled.size();
+    }
+
+    if (!levelFixup(Level.data, size, Level.header)) {
+        fprintf (stderr, "%s.lvl is damaged or from another version\n", name);
+        unloadLevel();
+        return false;
+    }
+    return true;
+}
+
+std::string directoryOf (const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+/* Append the file to 'out', replacing each #include "name" line (relative to the including file) with that file */
+bool expandShaderSource (const std::string& path, std::string& out, std::vector<std::string>& files, int depth)
+{
+    // Listed even when it can't be read, so the program is rebuilt once the file is back
+    files.push_back (path);
+    std::string text;
+    if (depth > MAX_INCLUDE_DEPTH || !readFile(path.c_str(), text)) {
+        fprintf(stderr, "Cannot read shader %s%s\n", path.c_str(), depth > MAX_INCLUDE_DEPTH ? " (includes nested too deep)" : "");
+        return false;
+    }
+    out.reserve (out.size() + text.size());
+
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos)
+            end = text.size();
+
+        size_t first = text.find_first_not_of(" \t", pos);
+        if (first < end && text.compare(first, 8, "#include") == 0) {
+            size_t open = text.find('"', first), close = open < end ? text.find('"', open + 1) : std::string::npos;
+            if (open >= end || close >= end) {
+                fprintf(stderr, "%s: malformed #include\n", path.c_str());
+                return false;
+            }
+            if (!expandShaderSource(directoryOf(path) + text.substr(open + 1, close - open - 1), out, files, depth + 1))
+                return false;
+        }
+        else
+            out.append (text, pos, end - pos);
+        out += '\n';
+        pos = end + 1;
+    }
+    return true;
+}
+
+/* Expanded source with the program's defines placed right after #version */
+bool loadShaderSource (const char* path, const std::string& defines, std::string& code, std::vector<std::string>& files)
+{
+    code.clear();
+    if (!expandShaderSource(path, code, files, 0))
+        return false;
+
+    size_t at = 0;
+    if (code.compare(0, 8, "#version") == 0) {
+        at = code.find('\n');
+        at = at == std::string::npos ? code.size() : at + 1;
+    }
+    code.insert (at, defines);
+    return true;
+}
+
+/* Let the driver compile on its own threads if it can. Returns true when compiles run in the background */
+bool enableParallelShaderCompile ()
+{
+    static int enabled = -1;
+    if (enabled >= 0)
+        return enabled;
+
+    MaxShaderCompilerThreadsProc maxThreads = NULL;
+    if (glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+        maxThreads = (MaxShaderCompilerThreadsProc) glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+    else if (GLAD_GL_ARB_parallel_shader_compile)
+        maxThreads = glMaxShaderCompilerThreadsARB;
+    if (maxThreads)
+        maxThreads (0xFFFFFFFF); // as many as the implementation likes
+
+    enabled = maxThreads != NULL;
+    return enabled;
+}
+
+/* Non-blocking check that a program submitted by submitShaderPrograms has finished linking */
+bool shaderProgramReady (const ShaderProgram* program)
+{
+    if (program->fromCache || !program->id || !enableParallelShaderCompile())
+        return true;
+    GLint done = GL_TRUE;
+    glGetProgramiv (program->id, GL_COMPLETION_STATUS_KHR, &done);
+    return done == GL_TRUE;
+}
+
+/* Print the info log of a shader or program, if there is one */
+void printInfoLog (GLuint object, bool isProgram)
+{
+    GLint InfoLogLength = 0;
+    if (isProgram)
+        glGetProgramiv (object, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    else
+        glGetShaderiv (object, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    if (InfoLogLength <= 1)
+        return;
+
+    std::vector<char> ErrorMessage(InfoLogLength);
+    if (isProgram)
+        glGetProgramInfoLog (object, InfoLogLength, NULL, &ErrorMessage[0]);
+    else
+        glGetShaderInfoLog (object, InfoLogLength, NULL, &ErrorMessage[0]);
+    fprintf(stdout, "%s\n", &ErrorMessage[0]);
+}
+
+/* Read sources and start compiling and linking - never waits on the driver. A program whose
+   sources can't all be read is skipped and left with id 0 */
+void submitShaderProgram (ShaderProgram* program, bool cacheable)
+{
+    program->files.clear();
+    program->fromCache = false;
+    program->vertexShader = program->fragmentShader = 0;
+    program->id = 0;
+    // Both are read either way, so every missing file is reported
+    bool vertexRead = loadShaderSource(program->vertexPath, program->defines, program->vertexCode, program->files);
+    bool fragmentRead = loadShaderSource(program->fragmentPath, program->defines, program->fragmentCode, program->files);
+    if (!vertexRead || !fragmentRead) {
+        printf("Skipping shaders : %s, %s\n", program->vertexPath, program->fragmentPath);
+        return;
+    }
+
+    // Warm start : reuse the program linked by an earlier run
+    if (cacheable) {
+        program->cachePath = programCachePath(program->vertexCode, program->fragmentCode);
+        program->id = loadCachedProgram(program->cachePath);
+        if (program->id) {
+            program->fromCache = true;
+            return;
+        }
+    }
+
+    printf("Compiling shaders : %s, %s\n", program->vertexPath, program->fragmentPath);
+    const char* VertexSourcePointer = program->vertexCode.c_str();
+    program->vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(program->vertexShader, 1, &VertexSourcePointer, NULL);
+    glCompileShader(program->vertexShader);
+
+    const char* FragmentSourcePointer = program->fragmentCode.c_str();
+    program->fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(program->fragmentShader, 1, &FragmentSourcePointer, NULL);
+    glCompileShader(program->fragmentShader);
+
+    // Linking right away is fine - the driver resolves the compiles first
+    program->id = glCreateProgram();
+    glAttachShader(program->id, program->vertexShader);
+    glAttachShader(program->id, program->fragmentShader);
+    if (cacheable)
+        glProgramParameteri(program->id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program->id);
+}
+
+/* Collect the results of submitShaderProgram, blocking if the driver is still busy. Returns the link status */
+bool finishShaderProgram (ShaderProgram* program, bool cacheable)
+{
+    if (program->fromCache)
+        return true;
+    if (!program->id)
+        return false;
+
+    GLint Result = GL_FALSE;
+    glGetProgramiv(program->id, GL_LINK_STATUS, &Result);
+    if (Result != GL_TRUE) {
+        printInfoLog(program->vertexShader, false);
+        printInfoLog(program->fragmentShader, false);
+    }
+    printInfoLog(program->id, true);
+
+    glDetachShader(program->id, program->vertexShader);
+    glDetachShader(program->id, program->fragmentShader);
+    glDeleteShader(program->vertexShader);
+    glDeleteShader(program->fragmentShader);
+
+    // Cold start : store the binary for the next run
+    if (cacheable && Result == GL_TRUE)
+        saveCachedProgram(program->cachePath, program->id);
+    return Result == GL_TRUE;
+}
+
+/* Programs handed to the driver by submitShaderPrograms and not queried yet */
+struct ShaderBuild {
+    std::vector<ShaderProgram*> programs;
+    double startTime;
+    bool cacheable, parallel;
+} PendingShaders;
+
+/* Start compiling and linking every program in the list without waiting for any of them.
+   The driver works on them while the caller gets on with something else */
+void submitShaderPrograms (const std::vector<ShaderProgram*>& programs)
+{
+    StartupStep step ("submit shaders");
+    PendingShaders.startTime = glfwGetTime();
+    PendingShaders.cacheable = programCacheSupported();
+    PendingShaders.parallel = enableParallelShaderCompile();
+
+    for (size_t i = 0; i < programs.size(); i++) {
+        submitShaderProgram(programs[i], PendingShaders.cacheable);
+        PendingShaders.programs.push_back(programs[i]);
+    }
+}
+
+/* Wait for the submitted programs and check their link status. Returns false if there were none */
+bool finishShaderPrograms ()
+{
+    if (PendingShaders.programs.empty())
+        return false;
+    StartupStep step ("finish shaders");
+
+    int cached = 0;
+    for (size_t i = 0; i < PendingShaders.programs.size(); i++) {
+        cached += PendingShaders.programs[i]->fromCache;
+        finishShaderProgram(PendingShaders.programs[i], PendingShaders.cacheable);
+    }
+
+    printf("Built %d programs (%d from binary cache%s) in %.2f ms\n", (int) PendingShaders.programs.size(), cached,
+           PendingShaders.parallel ? ", parallel compile" : "", (glfwGetTime() - PendingShaders.startTime)*1000);
+    PendingShaders.programs.clear();
+    return true;
+}
+
+ShaderProgram* newShaderProgram (const char* vertex_file_path, const char* fragment_file_path, const char* defines="")
+{
+    ShaderProgram* program = new ShaderProgram;
+    program->vertexPath = vertex_file_path;
+    program->fragmentPath = fragment_file_path;
+    program->defines = defines;
+    program->id = 0;
+    return program;
+}
+
+static void error_callback(int error, const char* description)
+{
+    fprintf(stderr, "Error: %s\n", description);
+}
+
+void stopWorkers ();
+void stopShaderHotReload ();
+void stopSimulation ();
+
+void quit(GLFWwindow *window)
+{
+    stopSimulation();
+    stopShaderHotReload();
+    stopWorkers();
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    exit(EXIT_SUCCESS);
+}
+
+glm::vec3 getRGBfromHue (int hue)
+{
+  float intp;
+  float fracp = modff(hue/60.0, &intp);
+  float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
+
+  if (hue < 60)
+    return glm::vec3(1,x,0);
+  else if (hue < 120)
+    return glm::vec3(x,1,0);
+  else if (hue < 180)
+    return glm::vec3(0,1,x);
+  else if (hue < 240)
+    return glm::vec3(0,x,1);
+  else if (hue < 300)
+    return glm::vec3(x,0,1);
+  else
+    return glm::vec3(1,0,x);
+}
+/* Per-frame uniform buffers : the Camera block holds VP and the Transforms block one vec4 per object */
+/* Must match the array size and block names in Sample_GL.vert and TextureRender.vert */
+#define MAX_DRAW_TRANSFORMS 1024
+#define CAMERA_BLOCK_BINDING 0
+#define TRANSFORM_BLOCK_BINDING 1
+
+struct FrameUniforms {
+    GLuint CameraBuffer;
+    GLuint TransformBuffer;
+    int TransformCapacity;  // entries allocated in TransformBuffer
+    int WindowAlign;        // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT in vec4 entries
+    int WindowStart;        // first entry of the range bound to TRANSFORM_BLOCK_BINDING, -1 if none
+} Uniforms;
+
+void createFrameUniforms ()
+{
+    StartupStep step ("createFrameUniforms");
+    GLint align = 16;
+    glGetIntegerv (GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    Uniforms.WindowAlign = max(1, (int) (align / sizeof(glm::vec4)));
+    Uniforms.WindowStart = -1;
+    Uniforms.TransformCapacity = 0;
+
+    glGenBuffers (1, &Uniforms.CameraBuffer);
+    glBindBuffer (GL_UNIFORM_BUFFER, Uniforms.CameraBuffer);
+    glBufferData (GL_UNIFORM_BUFFER, sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase (GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, Uniforms.CameraBuffer);
+
+    glGenBuffers (1, &Uniforms.TransformBuffer);
+}
+
+/* Point the program's uniform blocks at our binding points, returns the transformBase location */
+GLint bindFrameUniformBlocks (GLuint program)
+{
+    GLuint camera = glGetUniformBlockIndex (program, "Camera");
+    GLuint transforms = glGetUniformBlockIndex (program, "Transforms");
+    if (camera != GL_INVALID_INDEX)
+        glUniformBlockBinding (program, camera, CAMERA_BLOCK_BINDING);
+    if (transforms != GL_INVALID_INDEX)
+        glUniformBlockBinding (program, transforms, TRANSFORM_BLOCK_BINDING);
+    return glGetUniformLocation (program, "transformBase");
+}
+
+/* Upload VP and every transform recorded this frame - one buffer update each per frame */
+void uploadFrameUniforms (const glm::mat4& VP, const vector<glm::vec4>& transforms)
+{
+    glBindBuffer (GL_UNIFORM_BUFFER, Uniforms.CameraBuffer);
+    glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), &VP[0][0]);
+
+    // Room for a full window past the last entry, so any aligned window stays inside the buffer
+    int needed = transforms.size() + MAX_DRAW_TRANSFORMS;
+    glBindBuffer (GL_UNIFORM_BUFFER, Uniforms.TransformBuffer);
+    if (needed > Uniforms.TransformCapacity)
+        Uniforms.TransformCapacity = needed;
+    // Orphan last frame's storage so we don't wait for draws still reading it
+    glBufferData (GL_UNIFORM_BUFFER, Uniforms.TransformCapacity*sizeof(glm::vec4), NULL, GL_STREAM_DRAW);
+    if (!transforms.empty())
+        glBufferSubData (GL_UNIFORM_BUFFER, 0, transforms.size()*sizeof(glm::vec4), &transforms[0]);
+    Uniforms.WindowStart = -1;
+}
+
+/* Make entries [first, first+count) visible to the shader, returns the index relative to the bound window */
+int bindTransformWindow (int first, int count)
+{
+    int start = Uniforms.WindowStart;
+    if (start < 0 || first < start || first + count > start + MAX_DRAW_TRANSFORMS) {
+        start = first - first % Uniforms.WindowAlign;
+        glBindBufferRange (GL_UNIFORM_BUFFER, TRANSFORM_BLOCK_BINDING, Uniforms.TransformBuffer,
+                           start*sizeof(glm::vec4), MAX_DRAW_TRANSFORMS*sizeof(glm::vec4));
+        Uniforms.WindowStart = start;
+    }
+    return first - start;
+}
+
+/* Radius of the circle around the model origin that encloses every vertex (x,y only) */
+float boundingRadius (int numVertices, const GLfloat* vertex_buffer_data)
+{
+    float r2 = 0;
+    for (int i=0; i<numVertices; i++) {
+        float x = vertex_buffer_data[3*i], y = vertex_buffer_data[3*i + 1];
+        r2 = max(r2, x*x + y*y);
+    }
+    return sqrt(r2);
+}
+
+/* Generate VAO, VBOs and return VAO handle. The VAO struct comes from 'arena' */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL, Arena& arena=EngineArena)
+{
+    struct VAO* vao = arenaNew<VAO>(arena);
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->FillMode = fill_mode;
+    vao->TextureBuffer = 0;
+    vao->Image = NULL; // untextured - the render queue sorts these apart from sprites
+    vao->Radius = boundingRadius(numVertices, vertex_buffer_data);
+
+    // Create Vertex Array Object
+    // Should be done after CreateWindow and before any other GL calls
+    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
+    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+
+    stateBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
+    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+    glVertexAttribPointer(
+                          0,                  // attribute 0. Vertices
+                          3,                  // size (x,y,z)
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          0,                  // stride
+                          (void*)0            // array buffer offset
+                          );
+    glEnableVertexAttribArray(0); // Enabled state is stored in the VAO
+
+    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
+    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
+    glVertexAttribPointer(
+                          1,                  // attribute 1. Color
+                          3,                  // size (r,g,b)
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          0,                  // stride
+                          (void*)0            // array buffer offset
+                          );
+    glEnableVertexAttribArray(1);
+
+    return vao;
+}
+
+/* New vertices and colours for a mesh of the same size, in the buffers it already has */
+void updateObject (struct VAO* vao, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data)
+{
+    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+    glBufferSubData (GL_ARRAY_BUFFER, 0, 3*vao->NumVertices*sizeof(GLfloat), vertex_buffer_data);
+    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer);
+    glBufferSubData (GL_ARRAY_BUFFER, 0, 3*vao->NumVertices*sizeof(GLfloat), color_buffer_data);
+    vao->Radius = boundingRadius(vao->NumVertices, vertex_buffer_data);
+}
+
+/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL, Arena& arena=EngineArena)
+{
+    std::vector<GLfloat> color_buffer_data (3*numVertices);
+    for (int i=0; i<numVertices; i++) {
+        color_buffer_data [3*i] = red;
+        color_buffer_data [3*i + 1] = green;
+        color_buffer_data [3*i + 2] = blue;
+    }
+
+    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode, arena);
+}
+
+struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, struct Texture* image, GLenum fill_mode=GL_FILL, Arena& arena=EngineArena)
+{
+  struct VAO* vao = arenaNew<VAO>(arena);
+  vao->PrimitiveMode = primitive_mode;
+  vao->NumVertices = numVertices;
+  vao->FillMode = fill_mode;
+  vao->Image = image;
+  vao->Radius = boundingRadius(numVertices, vertex_buffer_data);
+
+  // Create Vertex Array Object
+  // Should be done after CreateWindow and before any other GL calls
+  glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+  glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
+  glGenBuffers (1, &(vao->TextureBuffer));  // VBO - textures
+
+  stateBindVertexArray (vao->VertexArrayID); // Bind the VAO
+  glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
+  glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+  glVertexAttribPointer(
+              0,                  // attribute 0. Vertices
+              3,                  // size (x,y,z)
+              GL_FLOAT,           // type
+              GL_FALSE,           // normalized?
+              0,                  // stride
+              (void*)0            // array buffer offset
+              );
+  glEnableVertexAttribArray(0); // Enabled state is stored in the VAO
 
-  // Bind Textures using texture units
-  glBindTexture(GL_TEXTURE_2D, vao->TextureID);
+  // Atlas sprites use coords inside their rectangle. Until the atlas is packed the original
+  // coords are kept aside, the atlas loader patches the buffer when it knows the rectangle
+  vector<GLfloat> texture_coords (texture_buffer_data, texture_buffer_data + 2*numVertices);
+  if (image->InAtlas && !image->Loaded)
+    image->PendingUVs.push_back (make_pair(vao, texture_coords));
+  else if (image->InAtlas)
+    remapTexCoords (image, numVertices, texture_buffer_data, &texture_coords[0]);
 
-  // Enable Vertex Attribute 2 - Texture
+  glBindBuffer (GL_ARRAY_BUFFER, vao->TextureBuffer); // Bind the VBO textures
+  glBufferData (GL_ARRAY_BUFFER, 2*numVertices*sizeof(GLfloat), &texture_coords[0], GL_STATIC_DRAW);  // Copy the vertex colors
+  glVertexAttribPointer(
+              2,                  // attribute 2. Textures
+              2,                  // size (s,t)
+              GL_FLOAT,           // type
+              GL_FALSE,           // normalized?
+              0,                  // stride
+              (void*)0            // array buffer offset
+              );
   glEnableVertexAttribArray(2);
-  // Bind the VBO to use
-  glBindBuffer(GL_ARRAY_BUFFER, vao->TextureBuffer);
+
+  return vao;
+}
+
+
+/* Render the VBOs handled by VAO */
+/* Attribute arrays and their buffers are recorded in the VAO at creation, so only the VAO is bound here */
+/* Draws 'instances' copies, using the consecutive transforms starting at 'transform' (see pushTransform) */
+void drawInstances (struct VAO* vao, GLint transformBaseID, int transform, int instances)
+{
+    // Large batches are split so each fits a window of the Transforms block
+    int batch = MAX_DRAW_TRANSFORMS - Uniforms.WindowAlign;
+    while (instances > 0) {
+        int count = min(instances, batch);
+        glUniform1i (transformBaseID, bindTransformWindow(transform, count));
+        glDrawArraysInstanced (vao->PrimitiveMode, 0, vao->NumVertices, count);
+        transform += count;
+        instances -= count;
+    }
+}
+
+void draw3DObject (struct VAO* vao, int transform, int instances=1)
+{
+    // Change the Fill Mode for this object
+    statePolygonMode (vao->FillMode);
+
+    // Bind the VAO to use
+    stateBindVertexArray (vao->VertexArrayID);
+
+    // Draw the geometry !
+    drawInstances (vao, Matrices.TransformBaseID, transform, instances);
+}
+
+void draw3DTexturedObject (struct VAO* vao, int transform, int instances=1)
+{
+  // Change the Fill Mode for this object
+  statePolygonMode (vao->FillMode);
+
+  // Bind the VAO to use
+  stateBindVertexArray (vao->VertexArrayID);
+
+  // Bind Textures using texture units - left bound, the cache skips the rebind for the next sprite
+  stateBindTexture (0, vao->Image->TextureID);
 
   // Draw the geometry !
-  glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+  drawInstances (vao, Matrices.TextureTransformBaseID, transform, instances);
+}
 
-  // Unbind Textures to be safe
-  glBindTexture(GL_TEXTURE_2D, 0);
+/**************************
+ * Job system             *
+ **************************/
+
+/* A fixed pool of worker threads pulling jobs off two queues. Only CPU work runs here -
+   the GL context stays with the main thread. Recording a frame goes in its own lane, taken
+   before anything else, so a frame never waits behind decodes or level loads */
+enum JobLane { JOB_BACKGROUND, JOB_FRAME };
+
+struct JobSystem {
+    vector<thread> threads;
+    deque<function<void()> > jobs[2];   // by JobLane
+    mutex lock;
+    condition_variable wake;
+    bool quitting;
+} Workers;
+
+/* Next job, frame work first. Call with Workers.lock held */
+bool takeJob (function<void()>& job)
+{
+    deque<function<void()> >& lane = Workers.jobs[JOB_FRAME].empty() ? Workers.jobs[JOB_BACKGROUND] : Workers.jobs[JOB_FRAME];
+    if (lane.empty())
+        return false;
+    job = lane.front();
+    lane.pop_front();
+    return true;
+}
+
+void workerLoop ()
+{
+    for (;;) {
+        function<void()> job;
+        {
+            unique_lock<mutex> guard (Workers.lock);
+            while (!takeJob(job)) {
+                if (Workers.quitting)
+                    return;
+                Workers.wake.wait (guard);
+            }
+        }
+        job();
+    }
+}
+
+/* One worker per core besides the main thread */
+void startWorkers ()
+{
+    int count = max(1, (int) thread::hardware_concurrency() - 1);
+    Workers.quitting = false;
+    for (int i=0; i<count; i++)
+        Workers.threads.push_back (thread(workerLoop));
+}
+
+/* Finish queued jobs and join the pool */
+void stopWorkers ()
+{
+    {
+        lock_guard<mutex> guard (Workers.lock);
+        Workers.quitting = true;
+    }
+    Workers.wake.notify_all();
+    for (size_t i=0; i<Workers.threads.size(); i++)
+        Workers.threads[i].join();
+    Workers.threads.clear();
+}
+
+/* Run one job queued in 'lane' on this thread, if there is one */
+bool runQueuedJob (JobLane lane)
+{
+    function<void()> job;
+    {
+        lock_guard<mutex> guard (Workers.lock);
+        if (Workers.jobs[lane].empty())
+            return false;
+        job = Workers.jobs[lane].front();
+        Workers.jobs[lane].pop_front();
+    }
+    job();
+    return true;
+}
+
+/* Run a job on some worker, fire and forget */
+void runJob (const function<void()>& job, JobLane lane = JOB_BACKGROUND)
+{
+    {
+        lock_guard<mutex> guard (Workers.lock);
+        Workers.jobs[lane].push_back (job);
+    }
+    Workers.wake.notify_one();
+}
+
+/* A parallelFor's chunks are claimed in turn by whoever gets there first, the calling thread
+   included. Shared, since helper jobs may only get to run after the call has returned */
+struct ParallelChunks {
+    atomic<int> next;
+    int chunks;
+    int remaining;
+    mutex lock;
+    condition_variable done;
+};
+
+/* Split [0, count) into at most one chunk per thread (and at least 'grain' items each), run
+   body(chunk, begin, end) on the workers and the calling thread, and wait for all of them.
+   Returns the number of chunks, so callers can keep per-chunk results */
+int parallelFor (int count, int grain, const function<void(int, int, int)>& body, JobLane lane = JOB_BACKGROUND)
+{
+    int chunks = min((int) Workers.threads.size() + 1, (count + grain - 1) / max(grain, 1));
+    if (chunks <= 1) {
+        if (count > 0)
+            body (0, 0, count);
+        return count > 0 ? 1 : 0;
+    }
+
+    shared_ptr<ParallelChunks> state = make_shared<ParallelChunks>();
+    state->next = 0;
+    state->chunks = chunks;
+    state->remaining = chunks;
+    // 'body' is only called for a claimed chunk, and the call doesn't return before every chunk is done
+    const function<void(int, int, int)>* work = &body;
+    function<void()> claim = [state, work, count] () {
+        for (int c; (c = state->next.fetch_add(1)) < state->chunks; ) {
+            (*work) (c, (int) ((int64_t) count * c / state->chunks), (int) ((int64_t) count * (c+1) / state->chunks));
+            lock_guard<mutex> guard (state->lock);
+            if (--state->remaining == 0)
+                state->done.notify_one();
+        }
+    };
+    for (int c=1; c<chunks; c++)
+        runJob (claim, lane);
+
+    // The calling thread works through chunks too, and only waits for chunks already running
+    // elsewhere. It never runs other jobs meanwhile, nor waits on a chunk no worker has taken
+    claim();
+    unique_lock<mutex> guard (state->lock);
+    while (state->remaining > 0)
+        state->done.wait (guard);
+    return chunks;
+}
+
+/**************************
+ * Render queue           *
+ **************************/
+
+/* Gameplay code submits draws with a 64-bit key instead of issuing GL calls in source order.
+   The key orders by layer first, then by the state that is expensive to change, so after
+   sorting each program, texture and VAO is bound once per layer. From most significant bit:
+     layer (4) | program (8) | texture (16) | VAO (16) | depth (20)                          */
+#define KEY_LAYER_SHIFT   60
+#define KEY_PROGRAM_SHIFT 52
+#define KEY_TEXTURE_SHIFT 36
+#define KEY_VAO_SHIFT     20
+#define KEY_DEPTH_BITS    20
+
+/* Layers are drawn in this order, objects in a higher layer are always drawn over lower ones */
+enum RenderLayer {
+    LAYER_BACKGROUND = 0,
+    LAYER_WORLD,
+    LAYER_ACTORS,
+    LAYER_HUD,
+};
+
+struct RenderCommand {
+    struct VAO* vao;
+    GLuint program;
+    int transform;   // first entry from pushTransform
+    int instances;
+};
+
+struct SortEntry {
+    uint64_t key;
+    uint32_t command;
+};
+
+/* Everything recorded for a frame : transforms for the Transforms block and the draws using them.
+   Worker threads record into lists of their own, which are appended to the frame's list after.
+   A frame's list is recorded off the GL thread (see Frame pipeline), so recording makes no GL calls */
+struct DrawList {
+    vector<glm::vec4> transforms;
+    vector<RenderCommand> commands;
+    vector<SortEntry> keys;
+    int tested;   // culling tests done while recording
+    int culled;
+};
+
+struct RenderQueue {
+    DrawList* frame;         // the list being recorded
+    vector<SortEntry> scratch;
+    vector<DrawList> workerLists;
+    int submitted;   // commands queued this frame
+    int batches;     // draws actually issued after sorting and merging
+} Queue;
+
+uint64_t makeDrawKey (int layer, GLuint program, GLuint texture, GLuint vertexArray, float depth)
+{
+    // Depth is only a tie breaker within the same state, 0 = first
+    depth = min(max(depth, 0.0f), 1.0f);
+    uint64_t d = (uint64_t) (depth * ((1 << KEY_DEPTH_BITS) - 1));
+    return ((uint64_t) (layer & 0xf) << KEY_LAYER_SHIFT)
+         | ((uint64_t) (program & 0xff) << KEY_PROGRAM_SHIFT)
+         | ((uint64_t) (texture & 0xffff) << KEY_TEXTURE_SHIFT)
+         | ((uint64_t) (vertexArray & 0xffff) << KEY_VAO_SHIFT)
+         | d;
+}
+
+void clearDrawList (DrawList& list)
+{
+    list.transforms.clear();
+    list.commands.clear();
+    list.keys.clear();
+    list.tested = list.culled = 0;
+}
+
+void beginRenderQueue (DrawList& list)
+{
+    Queue.frame = &list;
+    clearDrawList (list);
+}
+
+/* Record an object transform, angle in degrees. Returns its entry for submitDraw */
+int pushTransform (DrawList& list, float x, float y, float angle=0, float scale=1)
+{
+    list.transforms.push_back (glm::vec4(x, y, angle*M_PI/180.0f, scale));
+    return list.transforms.size() - 1;
+}
+
+int pushTransform (float x, float y, float angle=0, float scale=1)
+{
+    return pushTransform (*Queue.frame, x, y, angle, scale);
+}
+
+/* Queue 'instances' copies of vao drawn with program, using the transforms starting at 'transform' */
+void submitDraw (DrawList& list, int layer, GLuint program, struct VAO* vao, int transform, int instances=1, float depth=0)
+{
+    RenderCommand command = { vao, program, transform, instances };
+    SortEntry entry = { makeDrawKey(layer, program, vao->Image ? vao->Image->TextureID : 0, vao->VertexArrayID, depth), (uint32_t) list.commands.size() };
+    list.commands.push_back (command);
+    list.keys.push_back (entry);
+}
+
+void submitDraw (int layer, GLuint program, struct VAO* vao, int transform, int instances=1, float depth=0)
+{
+    submitDraw (*Queue.frame, layer, program, vao, transform, instances, depth);
+}
+
+/* Append a list recorded elsewhere, moving its transform and command indices past ours */
+void appendDrawList (DrawList& list, const DrawList& other)
+{
+    int transformBase = list.transforms.size();
+    uint32_t commandBase = list.commands.size();
+
+    list.transforms.insert (list.transforms.end(), other.transforms.begin(), other.transforms.end());
+    for (size_t i = 0; i < other.commands.size(); i++) {
+        RenderCommand command = other.commands[i];
+        command.transform += transformBase;
+        list.commands.push_back (command);
+
+        SortEntry entry = other.keys[i];
+        entry.command += commandBase;
+        list.keys.push_back (entry);
+    }
+    list.tested += other.tested;
+    list.culled += other.culled;
+}
+
+/* Objects recorded per job at least, below that splitting costs more than it saves */
+#define RECORD_OBJECTS_PER_JOB 512
+
+/* Record count items on the workers, body(list, begin, end) fills one list per chunk.
+   Lists are appended in chunk order, so the result matches recording them on this thread */
+void recordParallel (int count, int grain, const function<void(DrawList&, int, int)>& body)
+{
+    if (Queue.workerLists.size() < Workers.threads.size() + 1)
+        Queue.workerLists.resize (Workers.threads.size() + 1);
+
+    int chunks = parallelFor (count, grain, [&] (int chunk, int begin, int end) {
+        DrawList& list = Queue.workerLists[chunk];
+        clearDrawList (list);
+        body (list, begin, end);
+    }, JOB_FRAME);
+
+    for (int c = 0; c < chunks; c++)
+        appendDrawList (*Queue.frame, Queue.workerLists[c]);
+}
+
+/* LSD radix sort on the keys, one byte per pass. Stable, so equal keys keep submission order.
+   Passes where every key has the same byte are skipped - most of the key is usually constant */
+void radixSortKeys (vector<SortEntry>& keys, vector<SortEntry>& scratch)
+{
+    size_t n = keys.size();
+    if (n < 2)
+        return;
+    scratch.resize (n);
+    SortEntry *src = &keys[0], *dst = &scratch[0];
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t count[256] = {};
+        for (size_t i = 0; i < n; i++)
+            count[(src[i].key >> shift) & 0xff]++;
+        if (count[(src[0].key >> shift) & 0xff] == n)
+            continue;
+
+        size_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++)
+            dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+        swap (src, dst);
+    }
+
+    if (src != &keys[0])
+        keys.swap (scratch);
+}
+
+/* Sort a recorded frame's commands and issue them. Neighbours with the same state and
+   consecutive transforms are merged into one instanced draw */
+void flushRenderQueue (DrawList& frame)
+{
+    radixSortKeys (frame.keys, Queue.scratch);
+    Queue.submitted = frame.commands.size();
+    Queue.batches = 0;
+
+    size_t n = frame.keys.size();
+    for (size_t i = 0; i < n; ) {
+        RenderCommand command = frame.commands[frame.keys[i].command];
+        uint64_t state = frame.keys[i].key >> KEY_VAO_SHIFT;
+
+        for (i++; i < n; i++) {
+            const RenderCommand& next = frame.commands[frame.keys[i].command];
+            if ((frame.keys[i].key >> KEY_VAO_SHIFT) != state || next.vao != command.vao
+                || next.program != command.program || next.transform != command.transform + command.instances)
+                break;
+            command.instances += next.instances;
+        }
+
+        stateUseProgram (command.program);
+        if (command.vao->Image != NULL)
+            draw3DTexturedObject (command.vao, command.transform, command.instances);
+        else
+            draw3DObject (command.vao, command.transform, command.instances);
+        Queue.batches++;
+    }
+}
+
+/**************************
+ * Texture loading        *
+ **************************/
+
+/* Images are decoded on the workers and uploaded by the GL thread through a pixel buffer,
+   a few rows per frame, into a texture of their own. Until that texture is complete the
+   handle points at a shared 1x1 placeholder, so loading never holds up a frame */
+#define TEXTURE_UPLOAD_BUDGET (1 << 20) // bytes copied to the GPU per frame
+
+struct TextureAtlas;
+
+struct TextureUpload {
+    struct Texture* texture;
+    struct TextureAtlas* atlas;   // set when the image is a packed atlas
+    std::string filename;
+    unsigned char* pixels;   // RGBA from SOIL, NULL if decoding failed
+    int width, height;
+    const unsigned char* cache;   // mapped texture cache file, used instead of SOIL when set
+    size_t cacheSize;             // length to unmap, 0 when the cache lives in the asset pack
+    GLuint staging;          // the real texture, until it is complete
+    GLuint pixelBuffer;
+    int rowsUploaded;
+};
+
+struct TextureLoader {
+    std::mutex lock;
+    std::vector<TextureUpload*> decoded;    // handed over by the workers
+    std::vector<TextureUpload*> uploading;  // GL thread only
+    GLuint placeholder;
+} Textures;
+
+/* Wrapping and filtering used for every texture */
+void setTextureParameters ()
+{
+  // Set texture wrapping to GL_REPEAT
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  // Set texture filtering (interpolation)
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+GLuint placeholderTexture ()
+{
+  if (Textures.placeholder == 0) {
+    static const unsigned char grey[4] = { 128, 128, 128, 255 };
+    glGenTextures(1, &Textures.placeholder);
+    stateBindTexture(0, Textures.placeholder);
+    setTextureParameters();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+    glGenerateMipmap(GL_TEXTURE_2D);
+  }
+  return Textures.placeholder;
+}
+
+/* Map the baked cache of an image, if there is one and it still matches the image on disk.
+   Compressed caches are only taken when the driver can sample them, and allowCompressed is
+   false for callers that need the pixels themselves */
+bool mapTextureCache (TextureUpload* upload, bool allowCompressed)
+{
+  std::string path = texCachePath(upload->filename.c_str());
+  const unsigned char* data;
+  size_t size, mapped = 0;
+
+  // Caches in the asset pack were baked together with their images, only loose ones can be stale
+  bool fresh = findAsset(path.c_str(), data, size);
+  if (!fresh) {
+    struct stat source, cached;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    if (stat(upload->filename.c_str(), &source) != 0 || fstat(fd, &cached) != 0 || cached.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    void* map = mmap(NULL, cached.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+      return false;
+
+    data = (const unsigned char*) map;
+    size = mapped = cached.st_size;
+    const TexCacheHeader* header = (const TexCacheHeader*) data;
+    fresh = size >= sizeof(TexCacheHeader)
+         && header->sourceSize == (uint64_t) source.st_size && header->sourceTime == (uint64_t) source.st_mtime;
+  }
+
+  const TexCacheHeader* header = (const TexCacheHeader*) data;
+  bool usable = fresh && texCacheValid(data, size)
+             && (header->format == TEXCACHE_RGBA8 || (allowCompressed && GLAD_GL_EXT_texture_compression_s3tc));
+  if (!usable) {
+    if (mapped)
+      munmap((void*) data, mapped);
+    return false;
+  }
+
+  upload->cache = data;
+  upload->cacheSize = mapped;
+  upload->width = header->width;
+  upload->height = header->height;
+  return true;
+}
+
+/* Level 0 straight out of an RGBA cache, or a fresh SOIL decode */
+void loadTexturePixels (TextureUpload* upload)
+{
+  if (mapTextureCache(upload, false)) {
+    const TexCacheLevel* levels = (const TexCacheLevel*) ((const TexCacheHeader*) upload->cache + 1);
+    upload->pixels = (unsigned char*) upload->cache + levels[0].offset;
+    return;
+  }
+  // RGBA keeps every row 4-byte aligned for the upload
+  const unsigned char* packed;
+  size_t packedSize;
+  if (findAsset(upload->filename.c_str(), packed, packedSize))
+    upload->pixels = SOIL_load_image_from_memory(packed, packedSize, &upload->width, &upload->height, 0, SOIL_LOAD_RGBA);
+  else
+    upload->pixels = SOIL_load_image(upload->filename.c_str(), &upload->width, &upload->height, 0, SOIL_LOAD_RGBA);
+  if (!upload->pixels)
+    fprintf(stderr, "Cannot load texture %s: %s\n", upload->filename.c_str(), SOIL_last_result());
+}
+
+void releaseTexturePixels (TextureUpload* upload)
+{
+  if (upload->cache) {
+    if (upload->cacheSize)
+      munmap((void*) upload->cache, upload->cacheSize);
+  }
+  else if (upload->pixels)
+    SOIL_free_image_data(upload->pixels); // Free the data read from file after creating opengl texture
+  upload->cache = upload->pixels = NULL;
+}
+
+void decodeTexture (TextureUpload* upload)
+{
+  // A baked mip chain goes up as it is, no decode here and no mipmap generation later
+  if (!mapTextureCache(upload, true))
+    loadTexturePixels(upload);
+
+  std::lock_guard<std::mutex> guard (Textures.lock);
+  Textures.decoded.push_back (upload);
+}
+
+struct Texture* newTexture ()
+{
+  struct Texture* texture = new struct Texture;
+  texture->TextureID = placeholderTexture();
+  texture->Width = texture->Height = 1;
+  texture->Loaded = false;
+  texture->InAtlas = false;
+  texture->AtlasRect[0] = texture->AtlasRect[1] = 0;
+  texture->AtlasRect[2] = texture->AtlasRect[3] = 1;
+  return texture;
+}
+
+TextureUpload* newTextureUpload (struct Texture* texture, const char* filename)
+{
+  TextureUpload* upload = new TextureUpload;
+  upload->texture = texture;
+  upload->atlas = NULL;
+  upload->filename = filename;
+  upload->pixels = NULL;
+  upload->width = upload->height = 0;
+  upload->cache = NULL;
+  upload->cacheSize = 0;
+  upload->staging = upload->pixelBuffer = 0;
+  upload->rowsUploaded = 0;
+  return upload;
+}
+
+/* Returns at once with the placeholder bound, the image follows over the next frames */
+struct Texture* createTexture (const char* filename)
+{
+  struct Texture* texture = newTexture();
+  TextureUpload* upload = newTextureUpload(texture, filename);
+  runJob([upload] () { decodeTexture(upload); });
+  return texture;
+}
+
+/* Copy the next rows into the pixel buffer and from there into the texture. Returns the bytes moved */
+size_t uploadTextureRows (TextureUpload* upload, size_t budget)
+{
+  size_t stride = 4 * upload->width;
+  int rows = min(upload->height - upload->rowsUploaded, max(1, (int) (budget / stride)));
+  size_t offset = upload->rowsUploaded * stride, size = rows * stride;
+
+  if (upload->staging == 0) {
+    glGenTextures(1, &upload->staging);
+    stateBindTexture(0, upload->staging);
+    setTextureParameters();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, upload->width, upload->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glGenBuffers(1, &upload->pixelBuffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->pixelBuffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, upload->height * stride, NULL, GL_STREAM_DRAW);
+  }
+  stateBindTexture(0, upload->staging);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->pixelBuffer);
+
+  // Each range is written once, so there is nothing for the GPU to be reading there yet
+  void* target = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, size,
+                                  GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  if (target) {
+    memcpy(target, upload->pixels + offset, size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  }
+  // Rows go in bottom-up, same as the glTexImage2D upload used to do
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, upload->rowsUploaded, upload->width, rows, GL_RGBA, GL_UNSIGNED_BYTE, (void*) offset);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  upload->rowsUploaded += rows;
+  return size;
+}
+
+/* Every level of a mapped cache file, handed to GL straight from the mapping */
+size_t uploadCachedTexture (TextureUpload* upload)
+{
+  const TexCacheHeader* header = (const TexCacheHeader*) upload->cache;
+  const TexCacheLevel* levels = (const TexCacheLevel*) (header + 1);
+  static const GLenum compressed[] = { 0, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT };
+
+  glGenTextures(1, &upload->staging);
+  stateBindTexture(0, upload->staging);
+  setTextureParameters();
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header->levels - 1);
+
+  size_t size = 0;
+  for (uint32_t i = 0; i < header->levels; i++) {
+    const void* data = upload->cache + levels[i].offset;
+    if (header->format == TEXCACHE_RGBA8)
+      glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, levels[i].width, levels[i].height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    else
+      glCompressedTexImage2D(GL_TEXTURE_2D, i, compressed[header->format], levels[i].width, levels[i].height, 0, levels[i].size, data);
+    size += levels[i].size;
+  }
+  upload->rowsUploaded = upload->height;
+  return size;
+}
+
+void finishAtlasUpload (TextureUpload* upload);
+
+void finishTextureUpload (TextureUpload* upload)
+{
+  if (upload->atlas) {
+    finishAtlasUpload(upload);
+    return;
+  }
+  if (upload->staging) {
+    if (!upload->cache) {
+      stateBindTexture(0, upload->staging);
+      glGenerateMipmap(GL_TEXTURE_2D); // Generate MipMaps to use
+      glDeleteBuffers(1, &upload->pixelBuffer);
+    }
+
+    upload->texture->TextureID = upload->staging;
+    upload->texture->Width = upload->width;
+    upload->texture->Height = upload->height;
+    upload->texture->Loaded = true;
+  }
+  releaseTexturePixels(upload);
+  delete upload;
+}
+
+/* Move decoded images to the GPU within the per-frame budget. Call once per frame from the GL thread */
+void pumpTextureUploads ()
+{
+  {
+    std::lock_guard<std::mutex> guard (Textures.lock);
+    Textures.uploading.insert(Textures.uploading.end(), Textures.decoded.begin(), Textures.decoded.end());
+    Textures.decoded.clear();
+  }
+
+  size_t budget = TEXTURE_UPLOAD_BUDGET;
+  while (!Textures.uploading.empty() && budget > 0) {
+    TextureUpload* upload = Textures.uploading.front();
+    if (upload->cache && !upload->atlas) {
+      // Whole chain in one go, the budget only holds back whatever comes after it
+      budget -= min(budget, uploadCachedTexture(upload));
+    }
+    else if (upload->pixels && upload->rowsUploaded < upload->height) {
+      size_t moved = uploadTextureRows(upload, budget);
+      budget -= min(budget, moved);
+      if (upload->rowsUploaded < upload->height)
+        continue;
+    }
+    Textures.uploading.erase(Textures.uploading.begin());
+    finishTextureUpload(upload);
+  }
+}
+
+
+/**************************
+ * Texture atlas          *
+ **************************/
+
+/* Sprites are decoded on the workers like any texture, then packed into one image with a
+   skyline packer and streamed up as a single texture. Every sprite handle ends up pointing at
+   that texture, and the VAOs made from them get their coords moved into the sprite's rectangle,
+   so all atlas sprites draw with one texture bind */
+#define ATLAS_PADDING 2          // pixels around each sprite, against mipmap bleeding
+#define ATLAS_MIN_SIZE 256
+#define ATLAS_MAX_SIZE 8192
+
+struct AtlasSprite {
+    struct Texture* texture;
+    TextureUpload* image;   // decoded pixels
+    int x, y;               // position in the atlas
+};
+
+struct TextureAtlas {
+    vector<AtlasSprite> sprites;
+    atomic<int> pending;    // sprites still decoding
+};
+
+struct SkylineNode {
+    int x, y, width;
+};
+
+/* Bottom-left skyline placement : the lowest spot where a w x h box fits. False if it doesn't fit */
+bool skylineInsert (vector<SkylineNode>& skyline, int atlasWidth, int atlasHeight, int w, int h, int& outX, int& outY)
+{
+    int best = -1, bestY = atlasHeight, bestWidth = atlasWidth + 1;
+    for (size_t i = 0; i < skyline.size(); i++) {
+        if (skyline[i].x + w > atlasWidth)
+            break;
+        int y = 0, spanned = 0;
+        for (size_t j = i; spanned < w; j++) {
+            y = max(y, skyline[j].y);
+            spanned += skyline[j].width;
+        }
+        if (y + h <= atlasHeight && (y < bestY || (y == bestY && skyline[i].width < bestWidth))) {
+            best = i;
+            bestY = y;
+            bestWidth = skyline[i].width;
+        }
+    }
+    if (best < 0)
+        return false;
+
+    outX = skyline[best].x;
+    outY = bestY;
+
+    // The new box becomes a node, nodes it covers shrink or go
+    SkylineNode node = { outX, bestY + h, w };
+    skyline.insert (skyline.begin() + best, node);
+    for (size_t i = best + 1; i < skyline.size(); ) {
+        int overlap = skyline[i-1].x + skyline[i-1].width - skyline[i].x;
+        if (overlap <= 0)
+            break;
+        if (overlap < skyline[i].width) {
+            skyline[i].x += overlap;
+            skyline[i].width -= overlap;
+            break;
+        }
+        skyline.erase (skyline.begin() + i);
+    }
+    // Neighbours at the same height merge
+    for (size_t i = 0; i + 1 < skyline.size(); ) {
+        if (skyline[i].y == skyline[i+1].y) {
+            skyline[i].width += skyline[i+1].width;
+            skyline.erase (skyline.begin() + i + 1);
+        }
+        else
+            i++;
+    }
+    return true;
+}
+
+bool tallerSprite (const AtlasSprite* a, const AtlasSprite* b)
+{
+    return a->image->height > b->image->height;
+}
+
+/* Place every sprite, growing the atlas until they fit. Returns false if they never do */
+bool packAtlas (TextureAtlas* atlas, int& width, int& height)
+{
+    vector<AtlasSprite*> order;
+    for (size_t i = 0; i < atlas->sprites.size(); i++)
+        if (atlas->sprites[i].image->pixels)
+            order.push_back (&atlas->sprites[i]);
+    sort (order.begin(), order.end(), tallerSprite);
+
+    for (width = height = ATLAS_MIN_SIZE; width <= ATLAS_MAX_SIZE; ) {
+        vector<SkylineNode> skyline (1);
+        skyline[0].x = skyline[0].y = 0;
+        skyline[0].width = width;
+
+        size_t placed = 0;
+        while (placed < order.size()
+               && skylineInsert(skyline, width, height, order[placed]->image->width + 2*ATLAS_PADDING,
+                                order[placed]->image->height + 2*ATLAS_PADDING, order[placed]->x, order[placed]->y))
+            placed++;
+        if (placed == order.size())
+            return true;
+
+        // Grow the short side first, keeps the atlas close to square
+        if (height < width)
+            height *= 2;
+        else
+            width *= 2;
+    }
+    return false;
+}
+
+/* Runs on the worker that decoded the last sprite : packs, copies the sprites in and hands the atlas to the uploader */
+void composeAtlas (TextureAtlas* atlas)
+{
+    int width, height;
+    TextureUpload* upload = newTextureUpload(NULL, "atlas");
+    upload->atlas = atlas;
+
+    if (packAtlas(atlas, width, height)) {
+        upload->width = width;
+        upload->height = height;
+        upload->pixels = (unsigned char*) calloc(width * height, 4);
+        for (size_t i = 0; i < atlas->sprites.size(); i++) {
+            AtlasSprite& sprite = atlas->sprites[i];
+            if (!sprite.image->pixels)
+                continue;
+            sprite.x += ATLAS_PADDING;
+            sprite.y += ATLAS_PADDING;
+            for (int row = 0; row < sprite.image->height; row++)
+                memcpy (upload->pixels + 4*((sprite.y + row) * width + sprite.x),
+                        sprite.image->pixels + 4*row*sprite.image->width, 4*sprite.image->width);
+        }
+    }
+    else
+        fprintf(stderr, "Sprites do not fit a %dx%d atlas\n", ATLAS_MAX_SIZE, ATLAS_MAX_SIZE);
+
+    lock_guard<mutex> guard (Textures.lock);
+    Textures.decoded.push_back (upload);
+}
+
+TextureAtlas* beginAtlas ()
+{
+    TextureAtlas* atlas = new TextureAtlas;
+    atlas->pending = 0;
+    return atlas;
+}
+
+/* Queue an image for the atlas, the returned handle is usable right away like createTexture's */
+struct Texture* addAtlasSprite (TextureAtlas* atlas, const char* filename)
+{
+    AtlasSprite sprite;
+    sprite.texture = newTexture();
+    sprite.texture->InAtlas = true;
+    sprite.image = newTextureUpload(sprite.texture, filename);
+    sprite.x = sprite.y = 0;
+    atlas->sprites.push_back (sprite);
+    return sprite.texture;
+}
+
+/* Start decoding every sprite added so far, the last one to finish packs the atlas */
+void buildAtlas (TextureAtlas* atlas)
+{
+    atlas->pending = atlas->sprites.size();
+    for (size_t i = 0; i < atlas->sprites.size(); i++) {
+        TextureUpload* image = atlas->sprites[i].image;
+        runJob([atlas, image] () {
+            loadTexturePixels(image);
+            if (--atlas->pending == 0)
+                composeAtlas(atlas);
+        });
+    }
+}
+
+/* GL thread, once the atlas texture is complete : point the sprites at it and fix up their VAOs */
+void finishAtlasUpload (TextureUpload* upload)
+{
+    TextureAtlas* atlas = upload->atlas;
+    if (upload->staging) {
+        stateBindTexture(0, upload->staging);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glDeleteBuffers(1, &upload->pixelBuffer);
+    }
+
+    for (size_t i = 0; i < atlas->sprites.size(); i++) {
+        AtlasSprite& sprite = atlas->sprites[i];
+        struct Texture* texture = sprite.texture;
+        if (upload->staging && sprite.image->pixels) {
+            texture->TextureID = upload->staging;
+            texture->Width = sprite.image->width;
+            texture->Height = sprite.image->height;
+            texture->AtlasRect[0] = (GLfloat) sprite.x / upload->width;
+            texture->AtlasRect[1] = (GLfloat) sprite.y / upload->height;
+            texture->AtlasRect[2] = (GLfloat) sprite.image->width / upload->width;
+            texture->AtlasRect[3] = (GLfloat) sprite.image->height / upload->height;
+        }
+        texture->Loaded = true;
+
+        for (size_t v = 0; v < texture->PendingUVs.size(); v++) {
+            struct VAO* vao = texture->PendingUVs[v].first;
+            vector<GLfloat>& coords = texture->PendingUVs[v].second;
+            remapTexCoords(texture, vao->NumVertices, &coords[0], &coords[0]);
+            glBindBuffer(GL_ARRAY_BUFFER, vao->TextureBuffer);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, coords.size()*sizeof(GLfloat), &coords[0]);
+        }
+        texture->PendingUVs.clear();
+
+        releaseTexturePixels(sprite.image);
+        delete sprite.image;
+    }
+
+    free(upload->pixels);
+    delete upload;
+    delete atlas;
+}
+
+
+/**************************
+ * Text                   *
+ **************************/
+
+/* arial.ttf is rasterized once into a signed distance field atlas and kept in FONT_CACHE_DIR,
+   later runs just read the atlas back. Strings are laid out into one vertex buffer as they are
+   added, and drawText puts the whole frame's text on screen with a single draw */
+#define FONT_FILE "arial.ttf"
+#define FONT_CACHE_DIR "fontcache"
+#define FONT_CACHE_MAGIC 0x31465344   // "DSF1"
+#define FONT_FIRST_CHAR 32
+#define FONT_CHAR_COUNT 95            // printable ASCII
+#define FONT_PIXEL_SIZE 48            // rasterized size, the distance field scales from there
+#define FONT_SPREAD 6                 // pixels of distance kept around each glyph edge
+
+struct Glyph {
+    float advance;          // pixels at FONT_PIXEL_SIZE
+    float left, top;        // bitmap corner from the pen position, y up
+    int width, height;      // bitmap size, spread border included
+    int x, y;               // in the atlas
+};
+
+struct FontCacheHeader {
+    uint32_t magic;
+    uint32_t pixelSize, spread, firstChar, glyphCount;
+    uint32_t atlasWidth, atlasHeight;
+    uint64_t sourceSize, sourceTime;   // see assetStamp
+    float lineHeight, ascender;
+};
+
+struct TextVertex {
+    GLfloat x, y;
+    GLfloat u, v;
+    GLubyte colour[4];
+};
+
+struct GlyphFont {
+    Glyph glyphs[FONT_CHAR_COUNT];
+    float lineHeight, ascender;     // pixels at FONT_PIXEL_SIZE
+    int atlasWidth, atlasHeight;
+    GLuint texture;
+    GLuint VertexArrayID, VertexBuffer;
+    size_t bufferCapacity;          // vertices
+    vector<TextVertex> vertices;    // this frame's strings
+} GL3Font;
+
+std::string fontCachePath (const char* source)
+{
+    std::string name = source;
+    for (size_t i = 0; i < name.size(); i++)
+        if (name[i] == '/')
+            name[i] = '_';
+    return std::string(FONT_CACHE_DIR) + "/" + name + ".sdf";
+}
+
+/* Distance field of one coverage bitmap : 0.5 on the outline, rising to 1 FONT_SPREAD pixels
+   inside and falling to 0 as far outside. Brute force over the spread window, which is cheap
+   at these sizes and only ever runs on a cache miss */
+void distanceField (const vector<unsigned char>& coverage, int width, int height, vector<unsigned char>& field)
+{
+    int fieldWidth = width + 2*FONT_SPREAD, fieldHeight = height + 2*FONT_SPREAD;
+    field.assign (fieldWidth * fieldHeight, 0);
+
+    for (int fy = 0; fy < fieldHeight; fy++)
+        for (int fx = 0; fx < fieldWidth; fx++) {
+            int sx = fx - FONT_SPREAD, sy = fy - FONT_SPREAD;
+            bool inside = sx >= 0 && sy >= 0 && sx < width && sy < height && coverage[sy*width + sx] >= 128;
+
+            int nearest = FONT_SPREAD * FONT_SPREAD;
+            for (int dy = -FONT_SPREAD; dy <= FONT_SPREAD; dy++)
+                for (int dx = -FONT_SPREAD; dx <= FONT_SPREAD; dx++) {
+                    int x = sx + dx, y = sy + dy, distance = dx*dx + dy*dy;
+                    if (distance >= nearest)
+                        continue;
+                    bool other = x >= 0 && y >= 0 && x < width && y < height && coverage[y*width + x] >= 128;
+                    if (other != inside)
+                        nearest = distance;
+                }
+
+            float d = sqrtf((float) nearest) / (2 * FONT_SPREAD);
+            float value = inside ? 0.5f + d : 0.5f - d;
+            field[fy*fieldWidth + fx] = (unsigned char) (255 * max(0.0f, min(1.0f, value)) + 0.5f);
+        }
+}
+
+/* Rasterize the printable ASCII range and pack the distance fields into one atlas */
+bool rasterizeFont (GlyphFont& font, const char* filename, vector<unsigned char>& atlas)
+{
+    FT_Library library;
+    FT_Face face;
+    if (FT_Init_FreeType(&library))
+        return false;
+    const unsigned char* packed;
+    size_t packedSize;
+    FT_Error failed = findAsset(filename, packed, packedSize)
+                    ? FT_New_Memory_Face(library, packed, packedSize, 0, &face)
+                    : FT_New_Face(library, filename, 0, &face);
+    if (failed) {
+        fprintf(stderr, "Cannot load font %s\n", filename);
+        FT_Done_FreeType(library);
+        return false;
+    }
+    FT_Set_Pixel_Sizes(face, 0, FONT_PIXEL_SIZE);
+    font.lineHeight = face->size->metrics.height / 64.0f;
+    font.ascender = face->size->metrics.ascender / 64.0f;
+
+    // FreeType is used from this thread only, the fields are what costs
+    vector<vector<unsigned char> > coverage (FONT_CHAR_COUNT), fields (FONT_CHAR_COUNT);
+    vector<int> widths (FONT_CHAR_COUNT), heights (FONT_CHAR_COUNT);
+    for (int c = 0; c < FONT_CHAR_COUNT; c++) {
+        Glyph& glyph = font.glyphs[c];
+        widths[c] = heights[c] = 0;
+        if (FT_Load_Char(face, FONT_FIRST_CHAR + c, FT_LOAD_RENDER) == 0) {
+            FT_GlyphSlot slot = face->glyph;
+            widths[c] = slot->bitmap.width;
+            heights[c] = slot->bitmap.rows;
+            coverage[c].resize (widths[c] * heights[c]);
+            for (int row = 0; row < heights[c]; row++)
+                memcpy (&coverage[c][row * widths[c]], slot->bitmap.buffer + row * slot->bitmap.pitch, widths[c]);
+            glyph.advance = slot->advance.x / 64.0f;
+            glyph.left = slot->bitmap_left - FONT_SPREAD;
+            glyph.top = slot->bitmap_top + FONT_SPREAD;
+        }
+        else
+            glyph.advance = glyph.left = glyph.top = 0;
+        glyph.width = widths[c] + 2*FONT_SPREAD;
+        glyph.height = heights[c] + 2*FONT_SPREAD;
+    }
+    FT_Done_Face(face);
+    FT_Done_FreeType(library);
+
+    parallelFor (FONT_CHAR_COUNT, 8, [&] (int /*chunk*/, int begin, int end) {
+        for (int c = begin; c < end; c++)
+            distanceField (coverage[c], widths[c], heights[c], fields[c]);
+    });
+
+    // Same skyline packer as the texture atlas, one pixel between glyphs
+    for (font.atlasWidth = font.atlasHeight = ATLAS_MIN_SIZE; ; ) {
+        vector<SkylineNode> skyline (1);
+        skyline[0].x = skyline[0].y = 0;
+        skyline[0].width = font.atlasWidth;
+
+        int c = 0;
+        while (c < FONT_CHAR_COUNT && skylineInsert(skyline, font.atlasWidth, font.atlasHeight,
+                                                    font.glyphs[c].width + 1, font.glyphs[c].height + 1,
+                                                    font.glyphs[c].x, font.glyphs[c].y))
+            c++;
+        if (c == FONT_CHAR_COUNT)
+            break;
+        if (font.atlasHeight < font.atlasWidth)
+            font.atlasHeight *= 2;
+        else
+            font.atlasWidth *= 2;
+    }
+
+    atlas.assign (font.atlasWidth * font.atlasHeight, 0);
+    for (int c = 0; c < FONT_CHAR_COUNT; c++) {
+        const Glyph& glyph = font.glyphs[c];
+        for (int row = 0; row < glyph.height; row++)
+            memcpy (&atlas[(glyph.y + row) * font.atlasWidth + glyph.x], &fields[c][row * glyph.width], glyph.width);
+    }
+    return true;
+}
+
+/* Read back a cached atlas, as long as it was made from this font file with these settings */
+bool loadFontCache (GlyphFont& font, const char* filename, vector<unsigned char>& atlas)
+{
+    uint64_t sourceSize, sourceStamp;
+    FontCacheHeader header;
+    if (!assetStamp(filename, sourceSize, sourceStamp))
+        return false;
+    FILE* in = fopen(fontCachePath(filename).c_str(), "rb");
+    if (!in)
+        return false;
+
+    bool loaded = fread(&header, sizeof(header), 1, in) == 1
+               && header.magic == FONT_CACHE_MAGIC && header.pixelSize == FONT_PIXEL_SIZE && header.spread == FONT_SPREAD
+               && header.firstChar == FONT_FIRST_CHAR && header.glyphCount == FONT_CHAR_COUNT
+               && header.atlasWidth <= ATLAS_MAX_SIZE && header.atlasHeight <= ATLAS_MAX_SIZE
+               && header.sourceSize == sourceSize && header.sourceTime == sourceStamp
+               && fread(font.glyphs, sizeof(Glyph), FONT_CHAR_COUNT, in) == FONT_CHAR_COUNT;
+    if (loaded) {
+        atlas.resize (header.atlasWidth * header.atlasHeight);
+        loaded = fread(&atlas[0], 1, atlas.size(), in) == atlas.size();
+        font.atlasWidth = header.atlasWidth;
+        font.atlasHeight = header.atlasHeight;
+        font.lineHeight = header.lineHeight;
+        font.ascender = header.ascender;
+    }
+    fclose(in);
+    return loaded;
+}
+
+void saveFontCache (const GlyphFont& font, const char* filename, const vector<unsigned char>& atlas)
+{
+    uint64_t sourceSize, sourceStamp;
+    if (!assetStamp(filename, sourceSize, sourceStamp))
+        return;
+    mkdir(FONT_CACHE_DIR, 0755);
+
+    FontCacheHeader header;
+    header.magic = FONT_CACHE_MAGIC;
+    header.pixelSize = FONT_PIXEL_SIZE;
+    header.spread = FONT_SPREAD;
+    header.firstChar = FONT_FIRST_CHAR;
+    header.glyphCount = FONT_CHAR_COUNT;
+    header.atlasWidth = font.atlasWidth;
+    header.atlasHeight = font.atlasHeight;
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceStamp;
+    header.lineHeight = font.lineHeight;
+    header.ascender = font.ascender;
+
+    std::string path = fontCachePath(filename), temp = path + ".tmp";
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (!out)
+        return;
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(font.glyphs, sizeof(Glyph), FONT_CHAR_COUNT, out);
+    fwrite(&atlas[0], 1, atlas.size(), out);
+    bool written = ferror(out) == 0;
+    if (fclose(out) == 0 && written)
+        rename(temp.c_str(), path.c_str());
+    else
+        remove(temp.c_str());
+}
+
+/* Load the glyph atlas (from the cache when possible) and set up the text vertex buffer */
+bool loadGlyphFont (const char* filename)
+{
+    StartupStep step ("loadGlyphFont");
+    GlyphFont& font = GL3Font;
+    vector<unsigned char> atlas;
+    double start_time = glfwGetTime();
+    bool cached = loadFontCache(font, filename, atlas);
+    if (!cached) {
+        if (!rasterizeFont(font, filename, atlas))
+            return false;
+        saveFontCache(font, filename, atlas);
+    }
+    printf("Font %s: %dx%d atlas %s in %.1f ms\n", filename, font.atlasWidth, font.atlasHeight,
+           cached ? "read from cache" : "rasterized", (glfwGetTime() - start_time)*1000);
+
+    glGenTextures(1, &font.texture);
+    stateBindTexture(0, font.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // The field is meant to be interpolated, and it is only ever drawn near its own size
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, font.atlasWidth, font.atlasHeight, 0, GL_RED, GL_UNSIGNED_BYTE, &atlas[0]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glGenVertexArrays(1, &font.VertexArrayID);
+    glGenBuffers(1, &font.VertexBuffer);
+    stateBindVertexArray(font.VertexArrayID);
+    glBindBuffer(GL_ARRAY_BUFFER, font.VertexBuffer);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*) offsetof(TextVertex, x));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(TextVertex), (void*) offsetof(TextVertex, colour));
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*) offsetof(TextVertex, u));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    font.bufferCapacity = 0;
+    return true;
+}
+
+/* Lay out a string for this frame's text draw. (x, y) is the top left corner and size the
+   line height, both in world units. Returns the width of the longest line */
+float addText (float x, float y, float size, const char* text, float r, float g, float b)
+{
+    GlyphFont& font = GL3Font;
+    // The atlas is loaded by the first string that needs it
+    static bool attempted = false;
+    if (font.texture == 0 && !attempted) {
+        attempted = true;
+        loadGlyphFont(FONT_FILE);
+    }
+    if (font.texture == 0)
+        return 0;
+
+    float scale = size / font.lineHeight, pen = x, width = 0;
+    float baseline = y - font.ascender * scale;
+    GLubyte red = (GLubyte) (255*r), green = (GLubyte) (255*g), blue = (GLubyte) (255*b);
+
+    for (const char* c = text; *c; c++) {
+        if (*c == '\n') {
+            width = max(width, pen - x);
+            pen = x;
+            baseline -= size;
+            continue;
+        }
+        int index = (unsigned char) *c - FONT_FIRST_CHAR;
+        if (index < 0 || index >= FONT_CHAR_COUNT)
+            index = '?' - FONT_FIRST_CHAR;
+        const Glyph& glyph = font.glyphs[index];
+
+        if (glyph.width > 2*FONT_SPREAD) {
+            float x0 = pen + glyph.left * scale, x1 = x0 + glyph.width * scale;
+            float y1 = baseline + glyph.top * scale, y0 = y1 - glyph.height * scale;
+            // Atlas rows are stored top row first
+            float u0 = (float) glyph.x / font.atlasWidth, u1 = (float) (glyph.x + glyph.width) / font.atlasWidth;
+            float v0 = (float) glyph.y / font.atlasHeight, v1 = (float) (glyph.y + glyph.height) / font.atlasHeight;
+
+            TextVertex quad[6] = {
+                { x0, y0, u0, v1, { red, green, blue, 255 } }, { x1, y0, u1, v1, { red, green, blue, 255 } },
+                { x1, y1, u1, v0, { red, green, blue, 255 } }, { x1, y1, u1, v0, { red, green, blue, 255 } },
+                { x0, y1, u0, v0, { red, green, blue, 255 } }, { x0, y0, u0, v1, { red, green, blue, 255 } }
+            };
+            font.vertices.insert (font.vertices.end(), quad, quad + 6);
+        }
+        pen += glyph.advance * scale;
+    }
+    return max(width, pen - x);
 }
 
-GLuint createTexture (const char* filename)
+/* Everything added since the last call, in one draw on top of the scene */
+void drawText ()
 {
-  GLuint TextureID;
-  // Generate Texture Buffer
-  glGenTextures(1, &TextureID);
-  // All upcoming GL_TEXTURE_2D operations now have effect on our texture buffer
-  glBindTexture(GL_TEXTURE_2D, TextureID);
-  // Set our texture parameters
-  // Set texture wrapping to GL_REPEAT
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  // Set texture filtering (interpolation)
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-  // Load image and create OpenGL texture
-  int twidth, theight;
-  unsigned char* image = SOIL_load_image(filename, &twidth, &theight, 0, SOIL_LOAD_RGB);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, twidth, theight, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-  glGenerateMipmap(GL_TEXTURE_2D); // Generate MipMaps to use
-  SOIL_free_image_data(image); // Free the data read from file after creating opengl texture
-  glBindTexture(GL_TEXTURE_2D, 0); // Unbind texture when done, so we won't accidentily mess it up
-
-  return TextureID;
+    GlyphFont& font = GL3Font;
+    if (font.vertices.empty())
+        return;
+
+    // Fresh storage every frame (orphaning), so this never waits on the GPU reading last frame's
+    glBindBuffer(GL_ARRAY_BUFFER, font.VertexBuffer);
+    font.bufferCapacity = max(font.bufferCapacity, 2 * font.vertices.size());
+    glBufferData(GL_ARRAY_BUFFER, font.bufferCapacity * sizeof(TextVertex), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, font.vertices.size() * sizeof(TextVertex), &font.vertices[0]);
+
+    stateUseProgram(fontProgramID);
+    stateBindVertexArray(font.VertexArrayID);
+    stateBindTexture(0, font.texture);
+    statePolygonMode(GL_FILL);
+
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDrawArrays(GL_TRIANGLES, 0, font.vertices.size());
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+
+    font.vertices.clear();
 }
 
 
@@ -356,40 +2635,47 @@ float triangle_rot_dir = 1;
 float rectangle_rot_dir = 1;
 bool triangle_rot_status = true;
 bool rectangle_rot_status = true;
+bool show_stats = false;
 
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
 
+void requestRestart ();
+void rewindGame ();
+
 void refreshValues()
 {
-   projectile_x_coordinate=-3,projectile_y_coordinate=-2,projectile_velocity=0,projectile_angle=0;
-   projectile_x_velocity=0,projectile_y_velocity=0;
+   projectile_velocity=0,projectile_angle=0;
+   transformOf(Projectile).x=Level.header.cannonX,transformOf(Projectile).y=Level.header.cannonY;
+   velocityOf(Projectile).x=0,velocityOf(Projectile).y=0;
    flag=0;
 
 }
-VAO *speedbar;
-void createSpeedbar()
+
+/* The speed bar for a launch speed, built into 'bar' or, once it exists, into its buffers */
+void createSpeedbar(VAO*& bar, double velocity)
 {
+  StartupStep step ("createSpeedbar");
     
     
   GLfloat vertex_buffer_data [] = {
         -3.5,0.5,0, // vertex 1
         -3.5,0,0, // vertex 2
-        (-3.3 + projectile_velocity/3),-0,0, // vertex 3
+        (-3.3 + velocity/3),-0,0, // vertex 3
 
        -3.5, 0.5,0, // vertex 1
-        (projectile_velocity/2 - 3.3), 0.5,0, // vertex 4
-        (-3.3 + projectile_velocity/3),0,0, // vertex 3
+        (velocity/2 - 3.3), 0.5,0, // vertex 4
+        (-3.3 + velocity/3),0,0, // vertex 3
       
     };
 
     GLfloat color_buffer_data [] = {
-        (1-(projectile_velocity/2.0)),1,1, // color 1
-        (1-(projectile_velocity/2.0)),1,0, // color 2
-        1,(projectile_velocity/2.0),0, // color 3
-        (1-(projectile_velocity/2.0)),1,1, // color 1
-        1,(projectile_velocity/2.0),0, // color 4
-        1,(projectile_velocity/2.0),0 // color 3
+        (1-(velocity/2.0)),1,1, // color 1
+        (1-(velocity/2.0)),1,0, // color 2
+        1,(velocity/2.0),0, // color 3
+        (1-(velocity/2.0)),1,1, // color 1
+        1,(velocity/2.0),0, // color 4
+        1,(velocity/2.0),0 // color 3
     
 
   /*      1,1,1,
@@ -400,7 +2686,11 @@ void createSpeedbar()
         1,1,1,
       */
     };
-    speedbar = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    // Rebuilt on every speed change, so after the first time only the buffer contents change
+    if (bar)
+      updateObject(bar, vertex_buffer_data, color_buffer_data);
+    else
+      bar = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
 }
 
 void changeOrtho(int temp)  // if temp ==1 then zoom in else zoom out
@@ -447,6 +2737,281 @@ void changeOrtho(int temp)  // if temp ==1 then zoom in else zoom out
 
 }
 
+/**************************
+ * View culling           *
+ **************************/
+
+struct ViewBounds {
+    float left, right, bottom, top;
+};
+
+/* The rectangle the ortho projection is built from - keep reshapeWindow and culling in sync.
+   Note the left edge has always come from ortho_y_min, so horizontal pans only move the right edge */
+ViewBounds currentViewBounds ()
+{
+    ViewBounds view = { ortho_y_min, ortho_x_max, ortho_y_min, ortho_y_max };
+    return view;
+}
+
+/* True if a circle of 'radius' at (x,y) lies entirely outside the view */
+bool cullObject (DrawList& list, const ViewBounds& view, float x, float y, float radius)
+{
+    list.tested++;
+    if (x + radius < view.left || x - radius > view.right || y + radius < view.bottom || y - radius > view.top) {
+        list.culled++;
+        return true;
+    }
+    return false;
+}
+
+bool cullObject (const ViewBounds& view, float x, float y, float radius)
+{
+    return cullObject (*Queue.frame, view, x, y, radius);
+}
+
+/* Objects that never move live in a uniform grid, so a frame only visits the cells the view
+   overlaps instead of every object in the level */
+#define CULL_CELL_SIZE 2.0f
+
+struct StaticDrawable {
+    struct VAO* vao;
+    ShaderProgram* shader;   // looked up each frame, the program may be hot reloaded
+    int layer;
+    float x, y, angle;
+    float radius;
+};
+
+typedef LevelVector<int> CullCell;
+typedef unordered_map<int64_t, CullCell, hash<int64_t>, equal_to<int64_t>, LevelAllocator<pair<const int64_t, CullCell> > > CullCells;
+
+// Objects and cells are on the level arena
+struct CullGrid {
+    LevelVector<StaticDrawable> objects;
+    CullCells cells;
+    vector<pair<int64_t, const CullCell*> > visible;  // cells overlapping this frame's view
+} StaticGrid;
+
+int64_t cellKey (int cx, int cy)
+{
+    return ((int64_t) cx << 32) | (uint32_t) cy;
+}
+
+int cellCoord (float v)
+{
+    return (int) floor(v / CULL_CELL_SIZE);
+}
+
+/* Register an object that is drawn at the same place every frame, angle in degrees */
+void addStaticDrawable (int layer, ShaderProgram* shader, struct VAO* vao, float x, float y, float angle=0)
+{
+    StaticDrawable object = { vao, shader, layer, x, y, angle, vao->Radius };
+    int index = StaticGrid.objects.size();
+    StaticGrid.objects.push_back (object);
+
+    for (int cx = cellCoord(x - object.radius); cx <= cellCoord(x + object.radius); cx++)
+        for (int cy = cellCoord(y - object.radius); cy <= cellCoord(y + object.radius); cy++)
+            StaticGrid.cells[cellKey(cx, cy)].push_back (index);
+}
+
+/* An object spanning several cells is only handled by its lowest cell inside the view, so
+   cells can be processed independently without drawing anything twice */
+void recordStaticCell (DrawList& list, const ViewBounds& view, int64_t key, const CullCell& cell)
+{
+    int cx = (int) (key >> 32), cy = (int) (uint32_t) key;
+    int x0 = cellCoord(view.left), y0 = cellCoord(view.bottom);
+
+    for (size_t i = 0; i < cell.size(); i++) {
+        const StaticDrawable& object = StaticGrid.objects[cell[i]];
+        if (max(cellCoord(object.x - object.radius), x0) != cx || max(cellCoord(object.y - object.radius), y0) != cy)
+            continue;
+        if (cullObject(list, view, object.x, object.y, object.radius))
+            continue;
+        submitDraw (list, object.layer, object.shader->id, object.vao, pushTransform(list, object.x, object.y, object.angle));
+    }
+}
+
+/* Push transforms and submit draws for the static objects inside the view, cells are spread over the workers */
+void submitStaticDrawables (const ViewBounds& view)
+{
+    vector<pair<int64_t, const CullCell*> >& visible = StaticGrid.visible;
+    visible.clear();
+
+    int x0 = cellCoord(view.left), x1 = cellCoord(view.right);
+    int y0 = cellCoord(view.bottom), y1 = cellCoord(view.top);
+    size_t objects = 0;
+    if ((int64_t) (x1 - x0 + 1) * (y1 - y0 + 1) <= (int64_t) StaticGrid.cells.size()) {
+        for (int cx = x0; cx <= x1; cx++)
+            for (int cy = y0; cy <= y1; cy++) {
+                CullCells::const_iterator cell = StaticGrid.cells.find(cellKey(cx, cy));
+                if (cell != StaticGrid.cells.end()) {
+                    visible.push_back (make_pair(cell->first, &cell->second));
+                    objects += cell->second.size();
+                }
+            }
+    }
+    else {
+        // Zoomed far out - fewer occupied cells than cells in view, walk those instead
+        for (CullCells::const_iterator cell = StaticGrid.cells.begin(); cell != StaticGrid.cells.end(); ++cell) {
+            int cx = (int) (cell->first >> 32), cy = (int) (uint32_t) cell->first;
+            if (cx >= x0 && cx <= x1 && cy >= y0 && cy <= y1) {
+                visible.push_back (make_pair(cell->first, &cell->second));
+                objects += cell->second.size();
+            }
+        }
+    }
+
+    // Jobs get whole cells, as many as hold about RECORD_OBJECTS_PER_JOB objects
+    int grain = objects ? max(1, (int) ((int64_t) RECORD_OBJECTS_PER_JOB * visible.size() / objects)) : 1;
+    int tested = Queue.frame->tested;
+    recordParallel (visible.size(), grain, [&] (DrawList& list, int begin, int end) {
+        for (int i = begin; i < end; i++)
+            recordStaticCell (list, view, visible[i].first, *visible[i].second);
+    });
+
+    // Objects in cells the view never touched were culled without being tested
+    int skipped = StaticGrid.objects.size() - (Queue.frame->tested - tested);
+    Queue.frame->tested += skipped;
+    Queue.frame->culled += skipped;
+}
+
+/**************************
+ * Input events           *
+ **************************/
+
+/* GLFW callbacks only record what happened to the game. Events go through a single producer,
+   single consumer ring (callbacks in, simulation out) and are applied at the start of a tick.
+   The ring is a fixed array with two counters, so a callback never allocates, locks or makes
+   GL calls. View changes, stats and quitting stay in the callbacks, they are not game state */
+#define INPUT_RING_SIZE 256   // power of two
+
+enum InputType { INPUT_KEY, INPUT_MOUSE_BUTTON, INPUT_CURSOR };
+
+struct InputEvent {
+    double time;       // glfwGetTime() when it happened
+    uint16_t type;     // InputType
+    uint16_t action;   // GLFW_PRESS, GLFW_RELEASE
+    int32_t code;      // key or mouse button
+    float x, y;        // cursor position in window coordinates
+};
+
+struct InputRing {
+    InputEvent events[INPUT_RING_SIZE];
+    alignas(64) atomic<uint32_t> head;   // next slot the producer writes
+    alignas(64) atomic<uint32_t> tail;   // next slot the consumer reads
+    uint32_t dropped;                    // events lost to a full ring, producer side
+} Input;
+
+bool pushInput (int type, int action, int code, double x=0, double y=0)
+{
+    uint32_t head = Input.head.load(memory_order_relaxed);
+    if (head - Input.tail.load(memory_order_acquire) == INPUT_RING_SIZE) {
+        Input.dropped++;
+        return false;
+    }
+    InputEvent& event = Input.events[head & (INPUT_RING_SIZE - 1)];
+    event.time = glfwGetTime();
+    event.type = type;
+    event.action = action;
+    event.code = code;
+    event.x = x;
+    event.y = y;
+    Input.head.store(head + 1, memory_order_release);
+    return true;
+}
+
+/* Oldest event, if it happened no later than 'until' */
+bool popInput (InputEvent& event, double until)
+{
+    uint32_t tail = Input.tail.load(memory_order_relaxed);
+    if (tail == Input.head.load(memory_order_acquire))
+        return false;
+    const InputEvent& next = Input.events[tail & (INPUT_RING_SIZE - 1)];
+    if (next.time > until)
+        return false;
+    event = next;
+    Input.tail.store(tail + 1, memory_order_release);
+    return true;
+}
+
+void fireProjectile ()
+{
+  if (flag!=1)
+  {
+    velocityOf(Projectile).x = (projectile_velocity*cos(projectile_angle*DEGREES_TO_RADIANS));
+    velocityOf(Projectile).y = (projectile_velocity*sin(projectile_angle*DEGREES_TO_RADIANS));
+    flag=1;
+  }
+}
+
+/* Aim from the cursor : the barrel points at it and the speed grows with its distance */
+void aimAt (double x_position, double y_position)
+{
+  double x_pos = x_position*(8.0f/600.0f);
+  double y_pos = y_position*(8.0f/600.0f);
+
+  y_pos *= -1;
+  x_pos -= 1;
+  y_pos += 6;
+
+  if (flag == 0)
+  {
+    projectile_angle = atan(y_pos/x_pos) * RADIANS_TO_DEGREES;
+    projectile_velocity = 0.8 * sqrt(pow( (x_pos - transformOf(Projectile).x),2) + pow( (y_pos - transformOf(Projectile).y), 2));
+  }
+}
+
+void applyKey (int key)
+{
+  switch (key) {
+    case GLFW_KEY_LEFT:
+      projectile_angle += 5;
+      break;
+    case GLFW_KEY_RIGHT:
+      projectile_angle -= 5;
+      break;
+    case GLFW_KEY_F:
+      rectangle_rot_status = !rectangle_rot_status;
+      projectile_velocity += 1.5;
+      break;
+    case GLFW_KEY_S:
+      triangle_rot_status = !triangle_rot_status;
+      projectile_velocity -= 1;
+      break;
+    case GLFW_KEY_SPACE:
+      fireProjectile();
+      break;
+    case GLFW_KEY_R:
+      refreshValues();
+      break;
+    case GLFW_KEY_L:
+      requestRestart();
+      break;
+    case GLFW_KEY_B:
+      rewindGame();
+      break;
+    default:
+      break;
+  }
+}
+
+/* Everything queued up to 'time', in the order it happened */
+void applyInput (double time)
+{
+  InputEvent event;
+  while (popInput(event, time)) {
+    if (event.type == INPUT_KEY && event.action == GLFW_RELEASE)
+      applyKey(event.code);
+    else if (event.type == INPUT_MOUSE_BUTTON && event.action == GLFW_RELEASE) {
+      if (event.code == GLFW_MOUSE_BUTTON_LEFT)
+        fireProjectile();
+      else if (event.code == GLFW_MOUSE_BUTTON_RIGHT)
+        rectangle_rot_dir *= -1;
+    }
+    else if (event.type == INPUT_CURSOR)
+      aimAt(event.x, event.y);
+  }
+}
+
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 {
      // Function is called first on GLFW_PRESS.
@@ -460,39 +3025,19 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
                 changeOrtho(2);             // 1 for zoom_in
                 break;
             case GLFW_KEY_LEFT:
-                changeOrtho(3);  
-                projectile_angle += 5;
+                changeOrtho(3);
                 break;
             case GLFW_KEY_RIGHT:
                 changeOrtho(4);
-                projectile_angle -= 5;
-                break;  
-            case GLFW_KEY_F:
-                rectangle_rot_status = !rectangle_rot_status;
-                projectile_velocity += 1.5;
-                createSpeedbar();
                 break;
-            case GLFW_KEY_S:
-                triangle_rot_status = !triangle_rot_status;
-                projectile_velocity -= 1;
-                createSpeedbar();
+            case GLFW_KEY_P:
+                show_stats = !show_stats;
                 break;
-            case GLFW_KEY_SPACE:
-                if (flag!=1)
-                {
-                  projectile_x_velocity = (projectile_velocity*cos(projectile_angle*3.14/180));
-                  projectile_y_velocity = (projectile_velocity*sin(projectile_angle*3.14/180));
-                  flag=1;
-                }
-                // do something ..
-                 break;
-            case GLFW_KEY_R:
-                refreshValues();
-                break;  
             default:
                 break;
-
         }
+        // Aim, speed, firing and restarts are the simulation's
+        pushInput(INPUT_KEY, action, key);
     }
     else if (action == GLFW_PRESS) {
         switch (key) {
@@ -521,33 +3066,9 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
 /* Executed when a mouse button is pressed/released */
 void mouseButton (GLFWwindow* window, int button, int action, int mods)
 {
-    switch (button) {
-        case GLFW_MOUSE_BUTTON_LEFT:
-            if (action == GLFW_RELEASE)
-                if (flag!=1)
-                {
-                  projectile_x_velocity = (projectile_velocity*cos(projectile_angle*3.14/180));
-                  projectile_y_velocity = (projectile_velocity*sin(projectile_angle*3.14/180));
-                  flag=1;
-                }
-                // do something ..
-                 break;
-                triangle_rot_dir *= -1;
-            break;
-        case GLFW_MOUSE_BUTTON_RIGHT:
-            if (action == GLFW_RELEASE) {
-                rectangle_rot_dir *= -1;
-            }
-            break;
-        default:
-            break;
-    }
-
+    pushInput(INPUT_MOUSE_BUTTON, action, button);
 }
 
-
-
-
 /* Executed when window is resized to 'width' and 'height' */
 /* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
 void reshapeWindow (GLFWwindow* window, int width, int height)
@@ -570,498 +3091,1385 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     // Perspective projection for 3D views
     // Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
 
-    // Ortho projection for 2D views
-    Matrices.projection = glm::ortho(ortho_y_min, ortho_x_max, ortho_y_min, ortho_y_max, 0.1f, 500.0f);
+    // Ortho projection for 2D views
+    ViewBounds view = currentViewBounds();
+    Matrices.projection = glm::ortho(view.left, view.right, view.bottom, view.top, 0.1f, 500.0f);
+}
+
+/**************************
+ * Procedural meshes      *
+ **************************/
+
+/* Vertex and colour tables worked out by the compiler. Each mesh is a constexpr object, so it
+   sits in read-only data and the create* functions only hand it to create3DObject */
+#define PROJECTILE_SEGMENTS 64
+#define CANNON_SEGMENTS 96
+#define PREVIEW_DOT_SEGMENTS 12
+
+constexpr double MESH_PI = 3.14159265358979323846;
+
+/* Taylor series after bringing x into [-pi, pi], good to ~1e-10 there */
+constexpr double meshSin (double x)
+{
+    while (x > MESH_PI)
+        x -= 2*MESH_PI;
+    while (x < -MESH_PI)
+        x += 2*MESH_PI;
+    double term = x, sum = x;
+    for (int n = 1; n < 12; n++) {
+        term *= -x*x / ((2*n) * (2*n + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+constexpr double meshCos (double x)
+{
+    return meshSin(x + MESH_PI/2);
+}
+
+/* Repeatable 0..1 noise, stands in for the rand() colours the projectile used to get */
+constexpr double meshNoise (unsigned seed, unsigned i)
+{
+    unsigned h = seed * 747796405u + i * 2891336453u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return (h & 0xffff) / 65535.0;
+}
+
+struct MeshColour {
+    double r, g, b;
+};
+
+template <int Vertices>
+struct MeshData {
+    static const int count = Vertices;
+    GLfloat vertices[3*Vertices];
+    GLfloat colours[3*Vertices];
+};
+
+/* Rim of a circle for GL_TRIANGLE_FAN. A non-zero seed scatters the blue channel */
+template <int Segments>
+constexpr MeshData<Segments> circleMesh (double radius, MeshColour colour, unsigned seed = 0)
+{
+    MeshData<Segments> mesh {};
+    for (int i = 0; i < Segments; i++) {
+        double angle = 2*MESH_PI * i / Segments;
+        mesh.vertices[3*i] = radius * meshCos(angle);
+        mesh.vertices[3*i + 1] = radius * meshSin(angle);
+        mesh.vertices[3*i + 2] = 0;
+        mesh.colours[3*i] = colour.r;
+        mesh.colours[3*i + 1] = colour.g;
+        mesh.colours[3*i + 2] = seed ? meshNoise(seed, i) : colour.b;
+    }
+    return mesh;
+}
+
+/* Two triangles covering [x0,x1] x [y0,y1], corners coloured counter-clockwise from (x0,y0) */
+constexpr MeshData<6> quadMesh (double x0, double y0, double x1, double y1,
+                                MeshColour c0, MeshColour c1, MeshColour c2, MeshColour c3)
+{
+    MeshData<6> mesh {};
+    const double x[4] = { x0, x1, x1, x0 }, y[4] = { y0, y0, y1, y1 };
+    const MeshColour c[4] = { c0, c1, c2, c3 };
+    const int corner[6] = { 0, 1, 2, 2, 3, 0 };
+    for (int i = 0; i < 6; i++) {
+        mesh.vertices[3*i] = x[corner[i]];
+        mesh.vertices[3*i + 1] = y[corner[i]];
+        mesh.vertices[3*i + 2] = 0;
+        mesh.colours[3*i] = c[corner[i]].r;
+        mesh.colours[3*i + 1] = c[corner[i]].g;
+        mesh.colours[3*i + 2] = c[corner[i]].b;
+    }
+    return mesh;
+}
+
+constexpr MeshColour MESH_BLACK = { 0, 0, 0 };
+constexpr MeshColour MESH_WHITE = { 1, 1, 1 };
+
+// Barriers shade from light grey at the bottom left to nearly black at the top left
+constexpr MeshColour BARRIER_SHADES[4] = { { 0.5, 0.5, 0.5 }, { 0.3, 0.3, 0.3 }, { 0.2, 0.2, 0.2 }, { 0.1, 0.1, 0.1 } };
+
+constexpr MeshData<6> TargetMesh = quadMesh(-0.2, -0.2, 0.2, 0.2, MESH_BLACK, MESH_BLACK, MESH_BLACK, MESH_BLACK);
+constexpr MeshData<6> BarrelMesh = quadMesh(0.2, 0, 0.3, 0.04, MESH_BLACK, MESH_BLACK, MESH_BLACK, MESH_BLACK);
+// The projectile's red and green used to come out of rand() above 1, so they were always 1
+constexpr MeshData<PROJECTILE_SEGMENTS> ProjectileMesh = circleMesh<PROJECTILE_SEGMENTS>(0.1, { 1, 1, 0 }, 1);
+constexpr MeshData<CANNON_SEGMENTS> CannonMesh = circleMesh<CANNON_SEGMENTS>(0.2, MESH_WHITE);
+constexpr MeshData<PREVIEW_DOT_SEGMENTS> PreviewDotMesh = circleMesh<PREVIEW_DOT_SEGMENTS>(0.03, { 0.15, 0.15, 0.15 });
+
+template <int Vertices>
+struct VAO* createMesh (GLenum primitive_mode, const MeshData<Vertices>& mesh, Arena& arena=EngineArena)
+{
+  return create3DObject(primitive_mode, Vertices, mesh.vertices, mesh.colours, GL_FILL, arena);
+}
+
+VAO  *rectangle, *circle, *cannon, *cannonrect;
+
+// Creates the rectangle object used in this sample code
+void createRectangle ()
+{
+  StartupStep step ("createRectangle");
+  // All targets share one mesh and are drawn as instances of it
+  rectangle = createMesh(GL_TRIANGLES, TargetMesh);
+}
+
+void createCircle()
+{
+  StartupStep step ("createCircle");
+  circle = createMesh(GL_TRIANGLE_FAN, ProjectileMesh);
+}
+
+void createCannon()
+{
+  StartupStep step ("createCannon");
+  cannon = createMesh(GL_TRIANGLE_FAN, CannonMesh);
+}
+
+void createCannonRectangle ()
+{
+  StartupStep step ("createCannonRectangle");
+  cannonrect = createMesh(GL_TRIANGLES, BarrelMesh);
+}
+
+VAO *previewdot;
+
+void createPreviewDot ()
+{
+  StartupStep step ("createPreviewDot");
+  previewdot = createMesh(GL_TRIANGLE_FAN, PreviewDotMesh);
+}
+
+VAO *backdrop, *ground;
+
+/* Textured scenery : the beach behind everything and a ground strip under the cannon.
+   Pushed back in z so the depth test keeps them behind the game objects in any draw order */
+void createBackdrop ()
+{
+  StartupStep step ("createBackdrop");
+  static const GLfloat backdrop_vertex_data [] = {
+    -4,-4,-0.2, // vertex 1
+    4,-4,-0.2, // vertex 2
+    4,4,-0.2, // vertex 3
+
+    4,4,-0.2, // vertex 3
+    -4,4,-0.2, // vertex 4
+    -4,-4,-0.2  // vertex 1
+  };
+
+  // Image rows are stored top row first, so t runs downwards
+  static const GLfloat backdrop_texture_data [] = {
+    0,1, // vertex 1
+    1,1, // vertex 2
+    1,0, // vertex 3
+
+    1,0, // vertex 3
+    0,0, // vertex 4
+    0,1  // vertex 1
+  };
+
+  // The ground image repeats four times along the strip. Atlas sprites can't wrap,
+  // so each repeat is its own quad with the full image on it
+  GLfloat ground_vertex_data [4*18], ground_texture_data [4*12];
+  for (int tile=0; tile<4; tile++) {
+    GLfloat left = -4 + 2*tile, right = left + 2;
+    GLfloat vertices [] = { left,-4,-0.1, right,-4,-0.1, right,-2.2,-0.1, right,-2.2,-0.1, left,-2.2,-0.1, left,-4,-0.1 };
+    memcpy (ground_vertex_data + 18*tile, vertices, sizeof(vertices));
+    memcpy (ground_texture_data + 12*tile, backdrop_texture_data, sizeof(backdrop_texture_data));
+  }
+
+  // Both images share one atlas texture
+  TextureAtlas* scenery = beginAtlas();
+  struct Texture* beach = addAtlasSprite(scenery, "beach.png");
+  struct Texture* sand = addAtlasSprite(scenery, "beach2.png");
+  buildAtlas(scenery);
+
+  backdrop = create3DTexturedObject(GL_TRIANGLES, 6, backdrop_vertex_data, backdrop_texture_data, beach, GL_FILL);
+  ground = create3DTexturedObject(GL_TRIANGLES, 24, ground_vertex_data, ground_texture_data, sand, GL_FILL);
+}
+
+/* Objects that move are built the first time a frame draws them rather than in initGL,
+   scenery in the culling grid is still built up front since the grid needs its bounds */
+VAO* lazyMesh (VAO*& mesh, void (*create) ())
+{
+  if (mesh == NULL)
+    create();
+  return mesh;
+}
+
+VAO* targetMesh () { return lazyMesh(rectangle, createRectangle); }
+VAO* projectileMesh () { return lazyMesh(circle, createCircle); }
+VAO* barrelMesh () { return lazyMesh(cannonrect, createCannonRectangle); }
+VAO* previewDotMesh () { return lazyMesh(previewdot, createPreviewDot); }
+
+/* HUD strings in the top left corner of the view, sized to it so zooming leaves them alone */
+double hud_fps_time = 0, hud_fps = 0;
+int hud_frames = 0;
+void drawHud (const ViewBounds& view, int score, double velocity)
+{
+  double current_time = glfwGetTime();
+  hud_frames++;
+  if (current_time - hud_fps_time >= 0.5) {
+    hud_fps = hud_frames / (current_time - hud_fps_time);
+    hud_fps_time = current_time;
+    hud_frames = 0;
+  }
+
+  char line[64];
+  float size = (view.top - view.bottom) / 24, x = view.left + size/2, y = view.top - size/2;
+  snprintf(line, sizeof(line), "Score %d", score);
+  addText(x, y, size, line, 1, 1, 1);
+  snprintf(line, sizeof(line), "Level %d", (int) level);
+  addText(x, y - size, size, line, 1, 1, 1);
+  snprintf(line, sizeof(line), "Velocity %.1f", velocity);
+  addText(x, y - 2*size, size, line, 1, 1, 1);
+  snprintf(line, sizeof(line), "%.0f fps", hud_fps);
+  addText(view.right - 4*size, y, size, line, 1, 1, 0);
+  drawText();
+}
+
+float camera_rotation_angle = 90;
+float rectangle_rotation = 0;
+float triangle_rotation = 0;
+
+  
+
+/* Render the scene with openGL */
+/* Edit this function according to your assignment */
+
+/**************************
+ * Game state             *
+ **************************/
+
+/* Everything the simulation changes, as one flat block : the aim and score globals, then the
+   transform, velocity and collider columns of each archetype in turn. The block is plain
+   bytes, so keeping, copying or branching a state is a memcpy, and saving or restoring one is
+   a memcpy per column. Columns only line up while the same entities exist, so a state carries
+   the world generation it was taken at and is refused once entities have come or gone */
+#define REWIND_EVERY 10       // ticks between the states kept for rewinding
+#define REWIND_STATES 50      // five seconds of them
+#define REWIND_SAVES 10       // states gone back per press of B, a second
+
+// Points of targets hit in chunks that have since been unloaded
+int banked_score = 0;
+
+struct GameStateHeader {
+    uint64_t generation;
+    uint64_t size;            // of the whole block
+    double velocity, angle;   // aim
+    int flag;
+    int bankedScore;
+};
+
+static_assert(is_trivially_copyable<GameStateHeader>::value && is_trivially_copyable<Transform>::value
+              && is_trivially_copyable<Velocity>::value && is_trivially_copyable<Collider>::value,
+              "game states are copied as bytes");
+
+typedef vector<unsigned char> GameState;
+
+// As spawnLevel left it, so a restart doesn't have to rebuild the level
+GameState LevelStart;
+// The view spawnLevel streamed the first chunks for
+ViewBounds LevelStartView;
+
+template <typename T>
+void saveColumn (unsigned char*& out, const LevelVector<T>& column)
+{
+  if (!column.empty())
+    memcpy(out, &column[0], column.size() * sizeof(T));
+  out += column.size() * sizeof(T);
+}
+
+template <typename T>
+void restoreColumn (const unsigned char*& in, LevelVector<T>& column)
+{
+  if (!column.empty())
+    memcpy(&column[0], in, column.size() * sizeof(T));
+  in += column.size() * sizeof(T);
+}
+
+size_t gameStateSize ()
+{
+  size_t size = sizeof(GameStateHeader);
+  for (size_t i = 0; i < World.archetypes.size(); i++) {
+    const Archetype& a = World.archetypes[i];
+    size += a.transforms.size() * sizeof(Transform) + a.velocities.size() * sizeof(Velocity)
+          + a.colliders.size() * sizeof(Collider);
+  }
+  return size;
+}
+
+uint64_t gameStateGeneration (const GameState& state)
+{
+  GameStateHeader header;
+  if (state.size() < sizeof(header))
+    return 0;
+  memcpy(&header, &state[0], sizeof(header));
+  return header.generation;
+}
+
+/* For a state whose entities have been spawned again, in the same order : it lines up with
+   the world of 'generation' */
+void setGameStateGeneration (GameState& state, uint64_t generation)
+{
+  if (state.size() >= sizeof(GameStateHeader))
+    memcpy(&state[offsetof(GameStateHeader, generation)], &generation, sizeof(generation));
+}
+
+/* Columns a system doesn't use are empty, so every column is saved. A kept state is
+   overwritten in place, which only allocates when the world has grown */
+void saveGameState (GameState& state)
+{
+  state.resize(gameStateSize());
+  GameStateHeader header = { world_generation, state.size(), projectile_velocity, projectile_angle, flag, banked_score };
+  memcpy(&state[0], &header, sizeof(header));
+  unsigned char* out = &state[sizeof(header)];
+  for (size_t i = 0; i < World.archetypes.size(); i++) {
+    const Archetype& a = World.archetypes[i];
+    saveColumn(out, a.transforms);
+    saveColumn(out, a.velocities);
+    saveColumn(out, a.colliders);
+  }
+}
+
+/* False, and nothing changed, if entities have come or gone since 'state' was saved */
+bool restoreGameState (const GameState& state)
+{
+  GameStateHeader header;
+  if (state.size() < sizeof(header))
+    return false;
+  memcpy(&header, &state[0], sizeof(header));
+  if (header.generation != world_generation || header.size != state.size())
+    return false;
+
+  projectile_velocity = header.velocity;
+  projectile_angle = header.angle;
+  flag = header.flag;
+  banked_score = header.bankedScore;
+  const unsigned char* in = &state[sizeof(header)];
+  for (size_t i = 0; i < World.archetypes.size(); i++) {
+    Archetype& a = World.archetypes[i];
+    restoreColumn(in, a.transforms);
+    restoreColumn(in, a.velocities);
+    restoreColumn(in, a.colliders);
+  }
+  return true;
+}
+
+// Recent states, on the simulation thread
+struct RewindHistory {
+    GameState states[REWIND_STATES];
+    int newest;               // index of the last one saved
+    int count;                // kept, all of the current generation
+    int ticks;                // since the last save
+} History;
+
+/* Called every tick, keeps a state every REWIND_EVERY */
+void recordHistory ()
+{
+  if (++History.ticks < REWIND_EVERY)
+    return;
+  History.ticks = 0;
+  // Those from before entities came or went can't be restored any more
+  if (History.count && gameStateGeneration(History.states[History.newest]) != world_generation)
+    History.count = 0;
+  History.newest = (History.newest + 1) % REWIND_STATES;
+  saveGameState(History.states[History.newest]);
+  History.count = min(History.count + 1, REWIND_STATES);
+}
+
+void resetSnapshotHistory ();
+
+/* Back REWIND_SAVES kept states, or as far as they go. Simulation thread */
+void rewindGame ()
+{
+  if (History.count == 0)
+    return;
+  int back = min(REWIND_SAVES, History.count - 1);
+  int index = (History.newest - back + REWIND_STATES) % REWIND_STATES;
+  if (!restoreGameState(History.states[index])) {
+    History.count = 0;
+    return;
+  }
+  History.newest = index;
+  History.count -= back;
+  History.ticks = 0;
+  // A jump, not a movement to interpolate
+  resetSnapshotHistory();
+}
+
+/**************************
+ * Systems                *
+ **************************/
+
+#define GROUND_LEVEL -2.0f
+#define SIMULATION_STEP 0.01   // seconds per physics tick
+#define TARGET_RADIUS 0.28f    // 0.2*2^(1/2), the target's corners
+#define TARGET_FALL_X 1.0f     // a hit target drifts right and drops, per second
+#define TARGET_FALL_Y -5.0f
+
+/* Does a circle of 'radius' at 'shot' overlap collider 'c' placed at 't' */
+bool touches (const Transform& shot, float radius, const Transform& t, const Collider& c)
+{
+  if (c.shape == COLLIDE_CIRCLE) {
+    float dx = shot.x - t.x, dy = shot.y - t.y;
+    return dx*dx + dy*dy < (c.radius + radius) * (c.radius + radius);
+  }
+  return shot.x > t.x + c.left - radius && shot.x < t.x + c.right + radius
+      && shot.y > t.y + c.bottom - radius && shot.y < t.y + c.top + radius;
+}
+
+/* Drag and gravity once fired, then bounces off the ground, barriers and targets */
+template <typename Physics>
+void projectileSystem (const Physics& physics)
+{
+  const Transform& shot = transformOf(Projectile);
+  Velocity& v = velocityOf(Projectile);
+  float radius = colliderOf(Projectile).radius;
+
+  if (flag == 1)
+    applyForces(physics, v.x, v.y);
+  bounceOffGround(physics, shot.y, GROUND_LEVEL, v.y);
+
+  // Barriers turn it back every tick it is inside, a target only the first time and only one per tick
+  bool bouncedOffTarget = false;
+  forEachArchetype(HAS_TRANSFORM | HAS_COLLIDER, [&] (Archetype& a) {
+    for (size_t i = 0; i < a.entities.size(); i++) {
+      Collider& c = a.colliders[i];
+      if (a.entities[i] == Projectile || !touches(shot, radius, a.transforms[i], c))
+        continue;
+      if (c.shape == COLLIDE_BOX)
+        bounceOffWall(physics, v.x);
+      else if (!c.bounced && !bouncedOffTarget) {
+        c.bounced = bouncedOffTarget = true;
+        v.x = -v.x * 0.8;
+      }
+    }
+  });
+}
+
+/* Everything with a velocity moves */
+void motionSystem (float dt)
+{
+  forEachArchetype(HAS_TRANSFORM | HAS_VELOCITY, [&] (Archetype& a) {
+    for (size_t i = 0; i < a.entities.size(); i++) {
+      Transform& t = a.transforms[i];
+      const Velocity& v = a.velocities[i];
+      t.x += v.x * dt;
+      t.y += v.y * dt;
+      if (v.wrapRight > v.wrapLeft && t.x > v.wrapRight)
+        t.x = v.wrapLeft;
+    }
+  });
+}
+
+/* Targets the projectile has touched are hit for good, and start to fall */
+void hitSystem ()
+{
+  const Transform& shot = transformOf(Projectile);
+  float radius = colliderOf(Projectile).radius;
+  forEachArchetype(HAS_TRANSFORM | HAS_VELOCITY | HAS_COLLIDER | HAS_SCORE, [&] (Archetype& a) {
+    for (size_t i = 0; i < a.entities.size(); i++) {
+      Collider& c = a.colliders[i];
+      if (c.hit || !(c.bounced || touches(shot, radius, a.transforms[i], c)))
+        continue;
+      c.hit = true;
+      a.velocities[i].x += TARGET_FALL_X;
+      a.velocities[i].y += TARGET_FALL_Y;
+    }
+  });
 }
 
-VAO  *rectangle, *circle, *cannon, *cannonrect;
-VAO *rectangle1,*rectangle2,*rectangle3,*rectangle4, *rectangle5 ,*rectangle6 ,*barrier1 , *barrier2;
-VAO *triangle[6];
+/* One simulation tick */
+void simulate ()
+{
+  if (physics_tuned)
+    projectileSystem(physics_tuning);
+  else
+    projectileSystem(TunedPhysics());
+  motionSystem(SIMULATION_STEP);
+  hitSystem();
+  transformOf(Barrel).angle = projectile_angle;
+}
 
-//Creates the triangle object used in this sample code
-void createTriangle (int temp)
+/* Points for every target hit so far */
+int scoreSystem ()
 {
-  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+  int points = banked_score;
+  forEachArchetype(HAS_COLLIDER | HAS_SCORE, [&] (Archetype& a) {
+    for (size_t i = 0; i < a.entities.size(); i++)
+      if (a.colliders[i].hit)
+        points += a.scores[i].points;
+  });
+  return points;
+}
 
-  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-  static const GLfloat vertex_buffer_data [] = {
-    0, 0.1,0, // vertex 0
-    -0.1,-0.1,0, // vertex 1
-    0.1,-0.1,0, // vertex 2
-  };
+// Level streaming, further down
+bool streamChunks (const ViewBounds& view, bool immediate);
+void releaseChunks ();
+void restreamChunks (const ViewBounds& view);
 
-  static const GLfloat color_buffer_data [] = {
-    1,0,0, // color 0
-    0,1,0, // color 1
-    0,0,1, // color 2
-  };
+/* The cannon, its barrel and the projectile of the loaded level, then the chunks of
+   targets and barriers around the view. The aim starts over too */
+void spawnLevel ()
+{
+  StartupStep step ("spawnLevel");
+  const LevelHeader& level = Level.header;
+  projectile_velocity = projectile_angle = 0;
+  flag = 0;
+
+  // Scenery that never moves goes into the culling grid once per level
+  addStaticDrawable(LAYER_BACKGROUND, TextureShader, backdrop, 0, 0);
+  addStaticDrawable(LAYER_BACKGROUND, TextureShader, ground, 0, 0);
+  addStaticDrawable(LAYER_WORLD, ColourShader, cannon, level.cannonX, level.cannonY);
+
+  Projectile = spawnEntity(HAS_TRANSFORM | HAS_VELOCITY | HAS_COLLIDER | HAS_RENDERABLE);
+  transformOf(Projectile) = { level.cannonX, level.cannonY, 0 };
+  colliderOf(Projectile).shape = COLLIDE_CIRCLE;
+  colliderOf(Projectile).radius = 0.1;
+  // The projectile starts inside the cannon, keep it on top
+  renderableOf(Projectile) = { projectileMesh, &ColourShader, LAYER_ACTORS };
+
+  Barrel = spawnEntity(HAS_TRANSFORM | HAS_RENDERABLE);
+  transformOf(Barrel) = { level.cannonX, level.cannonY, 0 };
+  renderableOf(Barrel) = { barrelMesh, &ColourShader, LAYER_WORLD };
+
+  // What is in view from the start is there for the first frame
+  LevelStartView = currentViewBounds();
+  streamChunks(LevelStartView, true);
+  saveGameState(LevelStart);
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  triangle[temp] = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_FILL);
+/* Everything spawned for the level goes at once : the streamed chunks are released, then the
+   containers on the level arena start over and the arena rewinds */
+void endLevel ()
+{
+  releaseChunks();
+  arenaForget(World);
+  arenaForget(StaticGrid.objects);
+  arenaForget(StaticGrid.cells);
+  Projectile = Barrel = -1;
+  arenaReset(LevelArena);
 }
 
-// Creates the rectangle object used in this sample code
-void createRectangle (int temp)
+/* Back to the start of the level, aim included, by putting the saved start back. If chunks
+   have streamed in or out since, the start chunks are streamed again first : spawned in the
+   same slots and order as spawnLevel did, they lay the columns out as they were when
+   LevelStart was saved */
+void restartLevel ()
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    -0.2,-0.2,0, // vertex 1
-    -0.2,0.2,0, // vertex 2
-    0.2, 0.2,0, // vertex 3
+  // Rewinding stops at the restart, it doesn't undo it
+  History.count = 0;
+  History.ticks = 0;
+  if (restoreGameState(LevelStart))
+    return;
+  restreamChunks(LevelStartView);
+  setGameStateGeneration(LevelStart, world_generation);
+  if (restoreGameState(LevelStart))
+    return;
+  endLevel();
+  spawnLevel();
+}
 
-    0.2, 0.2,0, // vertex 3
-    0.2, -0.2,0, // vertex 4
-    -0.2,-0.2,0  // vertex 1
-  };
+/**************************
+ * Trajectory preview     *
+ **************************/
 
-  static const GLfloat color_buffer_data [] = {
-    0,0,0, // color 1
-    0,0,0, // color 2
-    0,0,0, // color 3
+/* Before a shot the path it would take is shown as a dotted arc, traced with the projectile's
+   own physics against the barriers (targets move, so they are left out). A trace is a few
+   hundred ticks, so paths are kept per aim bucket, the angle and speed rounded to
+   PREVIEW_ANGLE_STEP and PREVIEW_SPEED_STEP, and traced from the middle of the bucket. While
+   the aim stays in its bucket a tick only compares keys. Paths traced before barriers came or
+   went with the level chunks are stale */
+#define PREVIEW_DOTS 40
+#define PREVIEW_DOT_TICKS 6       // ticks between dots
+#define PREVIEW_ANGLE_STEP 0.5    // degrees
+#define PREVIEW_SPEED_STEP 0.05
+#define PREVIEW_CACHE 64          // paths kept, replaced in turn
+
+struct PreviewPath {
+    uint64_t generation;          // of the world it was traced in, 0 for an unused entry
+    int64_t key;
+    int dots;
+    float points[2*PREVIEW_DOTS];
+};
 
-    0,0,0, // color 3
-    0,0,0, // color 4
-    0,0,0  // color 1
-  };
+struct TrajectoryPreview {
+    PreviewPath cache[PREVIEW_CACHE];
+    int next;                     // entry the next trace replaces
+    const PreviewPath* shown;     // NULL when there is nothing to show
+    uint64_t version;             // moves on whenever what is shown changes
+    vector<ShotBarrier> barriers;   // gathered for a trace
+} Preview;
 
-  array_collisions[temp].radius=0.28;  // radius = 4*2^(1/2)
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  if (temp==1)
-    rectangle1 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  if (temp==2)
-    rectangle2 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  if (temp==3)
-    rectangle3 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  if (temp==4)
-    rectangle4 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  if (temp==5)
-    rectangle5 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  if (temp==6)
-    rectangle6 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+int64_t previewKey (double angle, double velocity)
+{
+  int64_t a = llround(angle / PREVIEW_ANGLE_STEP), v = llround(velocity / PREVIEW_SPEED_STEP);
+  return (int64_t) ((uint64_t) a << 32 | (uint32_t) v);
 }
 
-void createCircle()
+/* The shot from the cannon at the centre of the key's bucket, tick by tick as
+   projectileSystem and motionSystem would move it, with a dot every PREVIEW_DOT_TICKS.
+   The tick is stepShot, which physbench times */
+template <typename Physics>
+void tracePath (const Physics& physics, int64_t key, PreviewPath& path)
 {
-      int i,k=0;
-      GLfloat vertex_buffer_data[1090]={};
-      GLfloat color_buffer_data[1090]={};
-      for (i = 0; i < 360; ++i)
-      {
-       vertex_buffer_data[k] = 0.1*cos(i*3.14/180);
-       color_buffer_data[k] = ((double) rand() / (RAND_MAX)) +1;
-       // cout << ((double) rand() / (RAND_MAX)) << endl;
-
-       k++;
-       vertex_buffer_data[k] = 0.1*sin(i*3.14/180);
-       color_buffer_data[k] = ((double) rand() / (RAND_MAX)) +1;
-       k++;
-       vertex_buffer_data[k] = 0;
-       color_buffer_data[k] = ((double) rand() / (RAND_MAX));
-       k++;
-     }
-
-     circle = create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+  double angle = (key >> 32) * PREVIEW_ANGLE_STEP, velocity = (int32_t) (uint32_t) key * PREVIEW_SPEED_STEP;
+  float x = Level.header.cannonX, y = Level.header.cannonY;
+  float vx = velocity * cos(angle * DEGREES_TO_RADIANS), vy = velocity * sin(angle * DEGREES_TO_RADIANS);
+  float radius = colliderOf(Projectile).radius, dt = SIMULATION_STEP;
+
+  Preview.barriers.clear();
+  forEachArchetype(HAS_TRANSFORM | HAS_COLLIDER, [&] (Archetype& a) {
+    for (size_t i = 0; i < a.entities.size(); i++) {
+      const Transform& t = a.transforms[i];
+      const Collider& c = a.colliders[i];
+      if (c.shape != COLLIDE_BOX)
+        continue;
+      // The bounds touches() tests against
+      ShotBarrier box = { t.x + c.left - radius, t.x + c.right + radius, t.y + c.bottom - radius, t.y + c.top + radius };
+      Preview.barriers.push_back(box);
+    }
+  });
+
+  path.generation = world_generation;
+  path.key = key;
+  path.dots = 0;
+  for (int tick = 1; path.dots < PREVIEW_DOTS; tick++) {
+    stepShot(physics, x, y, vx, vy, Preview.barriers.data(), Preview.barriers.size(), GROUND_LEVEL, dt);
+    if (tick % PREVIEW_DOT_TICKS == 0) {
+      path.points[2*path.dots] = x;
+      path.points[2*path.dots + 1] = y;
+      path.dots++;
+    }
+  }
 }
 
-void createCannon()
+/* Once a tick on the simulation thread, after input. Nothing is shown once fired or without speed */
+void previewSystem ()
 {
-      int i,k=0;
-      GLfloat vertex_buffer_data[1090]={};
-      GLfloat color_buffer_data[1090]={};
-      for (i = 0; i < 360; ++i)
-      {
-       vertex_buffer_data[k] = 0.2*cos(i*3.14/180);
-       color_buffer_data[k] = 1;//((double) rand() / (RAND_MAX)) +1;
-       // cout << ((double) rand() / (RAND_MAX)) << endl;
+  const PreviewPath* shown = NULL;
+  if (flag == 0 && projectile_velocity > 0) {
+    int64_t key = previewKey(projectile_angle, projectile_velocity);
+    if (Preview.shown && Preview.shown->key == key && Preview.shown->generation == world_generation)
+      return;
+    for (int i = 0; i < PREVIEW_CACHE && !shown; i++)
+      if (Preview.cache[i].key == key && Preview.cache[i].generation == world_generation)
+        shown = &Preview.cache[i];
+    if (!shown) {
+      PreviewPath& path = Preview.cache[Preview.next];
+      Preview.next = (Preview.next + 1) % PREVIEW_CACHE;
+      if (physics_tuned)
+        tracePath(physics_tuning, key, path);
+      else
+        tracePath(TunedPhysics(), key, path);
+      shown = &path;
+      // The entry may be the one on show, with a new path in it
+      Preview.version++;
+    }
+  }
+  if (shown != Preview.shown) {
+    Preview.shown = shown;
+    Preview.version++;
+  }
+}
 
-       k++;
-       vertex_buffer_data[k] = 0.2*sin(i*3.14/180);
-       color_buffer_data[k] = 1;//((double) rand() / (RAND_MAX)) +1;
-       k++;
-       vertex_buffer_data[k] = 0;
-       color_buffer_data[k] = 1;//((double) rand() / (RAND_MAX));
-       k++;
-     }
+/**************************
+ * Simulation thread      *
+ **************************/
 
-     cannon = create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
-}
+/* The systems above run on their own thread at a fixed SIMULATION_STEP, whatever the frame
+   rate. After each tick the simulation publishes what the renderer needs as a snapshot through
+   a triple buffer : the writer always has a buffer to fill, the reader always has a complete
+   one, and swapping is a single atomic exchange, so neither side waits for the other. The
+   renderer interpolates between the last two ticks carried in the snapshot */
+#define SNAPSHOT_FRESH 4   // flag on the shared index : published and not yet taken
+#define SIMULATION_MAX_LAG 0.25   // seconds behind after which missed ticks are dropped
+
+struct SpriteState {
+    float x, y, angle;
+    float lastX, lastY, lastAngle;    // one tick earlier
+    VAO* (*mesh) ();
+    ShaderProgram** shader;
+    int layer;
+};
 
-void createCannonRectangle ()
+struct Snapshot {
+    double time;                      // of the tick it was taken after
+    vector<SpriteState> sprites;
+    vector<VAO* (*) ()> meshes;       // every mesh the sprites use
+    int score;
+    double velocity;                  // aim, for the speed bar and HUD
+    vector<float> preview;            // x, y of each dot of the aim's path
+    uint64_t previewVersion;          // Preview.version the dots are from
+};
+
+struct SimulationThread {
+    Snapshot buffers[3];
+    atomic<int> shared;               // buffer index, | SNAPSHOT_FRESH when newly published
+    int back;                         // simulation's
+    int front;                        // renderer's
+    vector<Transform> last;           // per entity, as of the previous tick
+
+    std::thread thread;
+    atomic<bool> running;
+    mutex tickLock;                   // held for a tick, taken by the GL thread to restart the level
+    atomic<bool> restartRequested;
+    atomic<uint64_t> ticks;
+} Sim;
+
+/* Fill the back buffer from the world and hand it over */
+void publishSnapshot (double time)
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    0.2,0,0, // vertex 1  
-    0.3,0,0, // vertex 2
-    0.3, 0.04,0, // vertex 3
+  Snapshot& snapshot = Sim.buffers[Sim.back];
+  snapshot.time = time;
+  snapshot.sprites.clear();
+  snapshot.meshes.clear();
+  snapshot.score = scoreSystem();
+  snapshot.velocity = projectile_velocity;
+  // Only buffers holding an older path are written to
+  if (snapshot.previewVersion != Preview.version) {
+    const PreviewPath* path = Preview.shown;
+    snapshot.preview.assign(path ? path->points : NULL, path ? path->points + 2*path->dots : NULL);
+    snapshot.previewVersion = Preview.version;
+  }
 
-    0.3, 0.04,0, // vertex 3
-    0.2, 0.04,0, // vertex 4
-    0.2,0,0  // vertex 1
-  };
+  if (Sim.last.size() < World.entities.size())
+    Sim.last.resize(World.entities.size());
+  forEachArchetype(HAS_TRANSFORM | HAS_RENDERABLE, [&] (Archetype& a) {
+    for (size_t i = 0; i < a.entities.size(); i++) {
+      const Transform& t = a.transforms[i];
+      const Renderable& r = a.renderables[i];
+      Transform& last = Sim.last[a.entities[i]];
+      SpriteState sprite = { t.x, t.y, t.angle, last.x, last.y, last.angle, r.mesh, r.shader, r.layer };
+      snapshot.sprites.push_back(sprite);
+      if (find(snapshot.meshes.begin(), snapshot.meshes.end(), r.mesh) == snapshot.meshes.end())
+        snapshot.meshes.push_back(r.mesh);
+      last = t;
+    }
+  });
 
-  static const GLfloat color_buffer_data [] = {
-    0,0,0, // color 1
-    0,0,0, // color 2
-    0,0,0, // color 3
+  Sim.back = Sim.shared.exchange(Sim.back | SNAPSHOT_FRESH) & 3;
+}
 
-    0,0,0, // color 3
-    0,0,0, // color 4
-    0,0,0  // color 1
-  };
-  cannonrect = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+/* The newest snapshot. Until another is published the same one keeps being returned */
+const Snapshot& acquireSnapshot ()
+{
+  if (Sim.shared.load(memory_order_relaxed) & SNAPSHOT_FRESH)
+    Sim.front = Sim.shared.exchange(Sim.front) & 3;
+  return Sim.buffers[Sim.front];
+}
+
+/* Where the level was one tick ago, so a fresh level doesn't interpolate from the old one */
+void resetSnapshotHistory ()
+{
+  Sim.last.assign(World.entities.size(), Transform());
+  forEachArchetype(HAS_TRANSFORM, [&] (Archetype& a) {
+    for (size_t i = 0; i < a.entities.size(); i++)
+      Sim.last[a.entities[i]] = a.transforms[i];
+  });
 }
 
-void createBarrier (int temp)
+void simulationLoop ()
 {
-  // GL3 accepts only Triangles. Quads are not supported
-   static const GLfloat vertex_buffer_data [] = {
-    -0.2,-1.7,0, // vertex 1
-    0.2,-1.7,0, // vertex 2
-    0.2, 1.5,0, // vertex 3
+  double next = glfwGetTime();
+  while (Sim.running.load()) {
+    double now = glfwGetTime();
+    if (now < next) {
+      this_thread::sleep_for(chrono::duration<double>(next - now));
+      continue;
+    }
+    {
+      lock_guard<mutex> tick (Sim.tickLock);
+      applyInput(next);
+      simulate();
+      recordHistory();
+      previewSystem();
+      publishSnapshot(next);
+    }
+    Sim.ticks++;
+    // Paused in a debugger or suspended : carry on from now instead of racing to catch up
+    next += SIMULATION_STEP;
+    if (now - next > SIMULATION_MAX_LAG)
+      next = now;
+  }
+}
 
-    0.2, 1.5,0, // vertex 3
-    -0.2, 1.5,0, // vertex 4
-    -0.2,-1.7,0  // vertex 1
-  };
+void startSimulation ()
+{
+  resetSnapshotHistory();
+  Sim.back = 0;
+  Sim.front = 1;
+  Sim.shared = 2;
+  // The first frame may come before the first tick
+  publishSnapshot(glfwGetTime());
+  acquireSnapshot();
+  Sim.running = true;
+  Sim.thread = std::thread(simulationLoop);
+}
 
-  static const GLfloat color_buffer_data [] = {
-    0.5,0.5,0.5, // color 1
-    0.3,0.3,0.3, // color 2
-    0.2,0.2,0.2, // color 3
+void stopSimulation ()
+{
+  if (!Sim.running.exchange(false))
+    return;
+  Sim.thread.join();
+}
 
-    0.2,0.2,0.2, // color 3
-    0.1,0.1,0.1, // color 4
-    0.5,0.5,0.5, // color 1
-  };
+void requestRestart ()
+{
+  Sim.restartRequested = true;
+}
 
+/* A restart asked for by input happens here on the GL thread, between ticks, since ending a
+   level deletes GL objects and rebuilds the culling grid the renderer reads */
+bool applyRestartRequest ()
+{
+  if (!Sim.restartRequested.exchange(false))
+    return false;
+  lock_guard<mutex> paused (Sim.tickLock);
+  restartLevel();
+  resetSnapshotHistory();
+  return true;
+}
 
-  //array_collisions[temp].radius=0.28;  // radius = 4*2^(1/2)
-  // create3DObject creates and returns a handle to a VAO that can be used later
-    barrier1 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  /*
-  if (temp==3)
-    rectangle3 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  if (temp==4)
-    rectangle4 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  */
+/* Every visible sprite of the snapshot into the queue, placed between its last two ticks.
+   Sprites of an archetype push consecutive transforms, so the queue merges their draws into
+   one instanced draw per mesh. The sprites are spread over the workers */
+void renderSystem (const ViewBounds& view, const Snapshot& snapshot, double now)
+{
+  float blend = min(max((now - snapshot.time) / SIMULATION_STEP, 0.0), 1.0);
+  recordParallel (snapshot.sprites.size(), RECORD_OBJECTS_PER_JOB, [&] (DrawList& list, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      const SpriteState& s = snapshot.sprites[i];
+      float x = s.x, y = s.y, angle = s.angle;
+      // Wrapping round the field is a jump, not a movement to smooth over
+      if (fabs(s.x - s.lastX) < 1 && fabs(s.y - s.lastY) < 1) {
+        x = s.lastX + (s.x - s.lastX) * blend;
+        y = s.lastY + (s.y - s.lastY) * blend;
+        angle = s.lastAngle + (s.angle - s.lastAngle) * blend;
+      }
+      VAO* mesh = s.mesh();
+      if (!cullObject(list, view, x, y, mesh->Radius))
+        submitDraw(list, s.layer, (*s.shader)->id, mesh, pushTransform(list, x, y, angle));
+    }
+  });
 }
 
-void createBarrier2 (int temp)
+/* The dots of the aim's path, all instances of the one mesh */
+void renderPreview (const ViewBounds& view, const Snapshot& snapshot)
 {
-  // GL3 accepts only Triangles. Quads are not supported
-static const    GLfloat vertex_buffer_data [] = {
-      -0.2,-1.2,0, // vertex 1
-      0.2,-1.2,0, // vertex 2
-      0.2, 1.0,0, // vertex 3
+  if (snapshot.preview.empty())
+    return;
+  VAO* dot = previewDotMesh();
+  for (size_t i = 0; i + 1 < snapshot.preview.size(); i += 2) {
+    float x = snapshot.preview[i], y = snapshot.preview[i + 1];
+    if (!cullObject(view, x, y, dot->Radius))
+      submitDraw(LAYER_WORLD, ColourShader->id, dot, pushTransform(x, y));
+  }
+}
 
-      0.2, 1,0, // vertex 3
-      -0.2, 1,0, // vertex 4
-      -0.2,-1.2,0  // vertex 1
-    };
+/**************************
+ * Level streaming        *
+ **************************/
 
-  static const GLfloat color_buffer_data [] = {
-    0.5,0.5,0.5, // color 1
-    0.3,0.3,0.3, // color 2
-    0.2,0.2,0.2, // color 3
+/* Only the chunks of the level (see level.h) around the view are in the world. A chunk
+   coming into range takes a slot and a job copies its targets and barriers out of the mapped
+   level and builds the barrier vertices, so page faults and mesh building stay off the GL
+   thread. The GL thread then uploads the meshes and spawns the entities, a chunk per frame,
+   between ticks. Chunks left far enough behind give their entities and buffers back. Slots
+   are fixed in number and each has its own arena, rewound on eviction, so memory and work
+   per frame depend on the view and not on the length of the level */
+#define CHUNK_SLOTS 6
+#define CHUNK_LOAD_MARGIN 2.0f        // chunks this close to the view are loaded
+#define CHUNK_KEEP_MARGIN 8.0f        // and kept until this far, so panning to and fro doesn't reload
+#define CHUNK_SPAWNS_PER_FRAME 1
+
+enum ChunkState { CHUNK_FREE, CHUNK_LOADING, CHUNK_LOADED, CHUNK_RESIDENT };
+
+struct ChunkSlot {
+    int chunk;                        // level chunk held, unless CHUNK_FREE
+    atomic<int> state;
+    Arena arena;                      // everything below
+    // From the load job
+    LevelTarget* targets;
+    uint32_t firstTarget, targetCount;   // firstTarget : level index of targets[0]
+    LevelBarrier* barriers;
+    uint32_t barrierCount;
+    MeshData<6>* barrierShapes;
+    int* shapeOf;                     // barrier i looks like barrier shapeOf[i], which has the mesh
+    // From the GL thread, once resident
+    VAO** barrierMeshes;
+    Entity* entities;                 // targets still standing, then barriers
+    uint32_t* targetIndex;            // level index of each of those targets
+    int targetEntities, entityCount;
+};
 
-    0.2,0.2,0.2, // color 3
-    0.1,0.1,0.1, // color 4
-    0.5,0.5,0.5, // color 1
-  };
+struct LevelStream {
+    ChunkSlot slots[CHUNK_SLOTS];
+    LevelVector<bool> targetsHit;     // per level target, set when a hit target is unloaded
+} Stream;
 
-  //array_collisions[temp].radius=0.28;  // radius = 4*2^(1/2)
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  if (temp==2)
-    barrier2 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  /*
-  if (temp==3)
-    rectangle3 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  if (temp==4)
-    rectangle4 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  */
+bool sameBox (const LevelBarrier& a, const LevelBarrier& b)
+{
+  return a.left == b.left && a.bottom == b.bottom && a.right == b.right && a.top == b.top;
 }
 
-float camera_rotation_angle = 90;
-float rectangle_rotation = 0;
-float triangle_rotation = 0;
-
-  
+/* Job : the chunk's records out of the mapping, and a mesh for each distinct barrier box */
+void loadChunk (ChunkSlot* slot)
+{
+  const LevelHeader& level = Level.header;
+  const LevelChunk& chunk = level.chunks.pointer[slot->chunk - level.firstChunk];
+  slot->firstTarget = chunk.firstTarget;
+  slot->targetCount = chunk.targetCount;
+  slot->targets = (LevelTarget*) arenaAlloc(slot->arena, chunk.targetCount * sizeof(LevelTarget));
+  memcpy(slot->targets, level.targets.pointer + chunk.firstTarget, chunk.targetCount * sizeof(LevelTarget));
+  slot->barrierCount = chunk.barrierCount;
+  slot->barriers = (LevelBarrier*) arenaAlloc(slot->arena, chunk.barrierCount * sizeof(LevelBarrier));
+  memcpy(slot->barriers, level.barriers.pointer + chunk.firstBarrier, chunk.barrierCount * sizeof(LevelBarrier));
+
+  slot->barrierShapes = (MeshData<6>*) arenaAlloc(slot->arena, chunk.barrierCount * sizeof(MeshData<6>));
+  slot->shapeOf = (int*) arenaAlloc(slot->arena, chunk.barrierCount * sizeof(int));
+  for (uint32_t i = 0; i < chunk.barrierCount; i++) {
+    const LevelBarrier& box = slot->barriers[i];
+    slot->shapeOf[i] = i;
+    for (uint32_t j = 0; j < i; j++)
+      if (sameBox(slot->barriers[j], box)) {
+        slot->shapeOf[i] = j;
+        break;
+      }
+    if (slot->shapeOf[i] == (int) i)
+      slot->barrierShapes[i] = quadMesh(box.left, box.bottom, box.right, box.top,
+                                        BARRIER_SHADES[0], BARRIER_SHADES[1], BARRIER_SHADES[2], BARRIER_SHADES[3]);
+  }
+  slot->state.store(CHUNK_LOADED, memory_order_release);
+}
 
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
+/* A reused entity id mustn't be interpolated from where its last owner was */
+void startHistory (Entity entity)
+{
+  if (Sim.last.size() <= (size_t) entity)
+    Sim.last.resize(entity + 1);
+  Sim.last[entity] = transformOf(entity);
+}
 
-void checkCollisionBarrier()
+/* A loaded chunk's meshes go up to the GPU and its entities are spawned. GL thread, between ticks */
+void spawnChunk (ChunkSlot& slot)
 {
-  //-1,-0.5
-  if (projectile_x_coordinate > -1.295 && projectile_x_coordinate < 0.95)
-    if (projectile_y_coordinate > -1.995 && projectile_y_coordinate < 1.15)
-    {
-     // projectile_y_velocity = -projectile_y_velocity*bounce;
-      projectile_x_velocity = -projectile_x_velocity * bounce;
-    }
+  slot.barrierMeshes = (VAO**) arenaAlloc(slot.arena, slot.barrierCount * sizeof(VAO*), alignof(VAO*));
+  for (uint32_t i = 0; i < slot.barrierCount; i++) {
+    int shape = slot.shapeOf[i];
+    slot.barrierMeshes[i] = shape == (int) i ? createMesh(GL_TRIANGLES, slot.barrierShapes[i], slot.arena) : slot.barrierMeshes[shape];
+  }
 
+  slot.entities = (Entity*) arenaAlloc(slot.arena, (slot.targetCount + slot.barrierCount) * sizeof(Entity));
+  slot.targetIndex = (uint32_t*) arenaAlloc(slot.arena, slot.targetCount * sizeof(uint32_t));
+  slot.entityCount = 0;
+
+  const unsigned targetMask = HAS_TRANSFORM | HAS_VELOCITY | HAS_COLLIDER | HAS_RENDERABLE | HAS_SCORE;
+  float left = levelChunkLeft(slot.chunk);
+  reserveEntities(targetMask, slot.targetCount);
+  for (uint32_t i = 0; i < slot.targetCount; i++) {
+    // Hit targets fell out of the level while their chunk was last in
+    if (Stream.targetsHit[slot.firstTarget + i])
+      continue;
+    const LevelTarget& t = slot.targets[i];
+    Entity target = spawnEntity(targetMask);
+    transformOf(target) = { t.x, t.y, 0 };
+    // Drifting targets come round again after leaving their chunk
+    velocityOf(target) = { t.drift, 0, left, t.drift != 0 ? left + LEVEL_CHUNK_WIDTH : left };
+    colliderOf(target).shape = COLLIDE_CIRCLE;
+    colliderOf(target).radius = TARGET_RADIUS;
+    renderableOf(target) = { targetMesh, &ColourShader, LAYER_WORLD };
+    scoreOf(target).points = t.points;
+    startHistory(target);
+    slot.targetIndex[slot.entityCount] = slot.firstTarget + i;
+    slot.entities[slot.entityCount++] = target;
+  }
+  slot.targetEntities = slot.entityCount;
+
+  // Barriers never move, so they are drawn straight from the slot rather than as renderables
+  reserveEntities(HAS_TRANSFORM | HAS_COLLIDER, slot.barrierCount);
+  for (uint32_t i = 0; i < slot.barrierCount; i++) {
+    const LevelBarrier& b = slot.barriers[i];
+    Entity barrier = spawnEntity(HAS_TRANSFORM | HAS_COLLIDER);
+    transformOf(barrier) = { b.x, b.y, 0 };
+    Collider& box = colliderOf(barrier);
+    box.shape = COLLIDE_BOX;
+    box.left = b.left, box.bottom = b.bottom, box.right = b.right, box.top = b.top;
+    slot.entities[slot.entityCount++] = barrier;
+  }
+  slot.state.store(CHUNK_RESIDENT, memory_order_release);
+}
 
-//1,-1
-  if (projectile_x_coordinate > -0.695 && projectile_x_coordinate < 1.305)
-    if (projectile_y_coordinate > -1.05 && projectile_y_coordinate < 0.105)
-    {
-     // projectile_y_velocity = -projectile_y_velocity*bounce;
-      projectile_x_velocity = -projectile_x_velocity * bounce;
+/* The slot's GL objects and arena go, and the slot is free */
+void releaseChunk (ChunkSlot& slot)
+{
+  if (slot.state.load() == CHUNK_RESIDENT) {
+    for (uint32_t i = 0; i < slot.barrierCount; i++) {
+      if (slot.shapeOf[i] != (int) i)
+        continue;
+      VAO* vao = slot.barrierMeshes[i];
+      GLuint buffers[2] = { vao->VertexBuffer, vao->ColorBuffer };
+      glDeleteBuffers(2, buffers);
+      glDeleteVertexArrays(1, &vao->VertexArrayID);
     }
-
+    stateInvalidate();
+  }
+  arenaReset(slot.arena);
+  slot.state.store(CHUNK_FREE);
 }
 
-
-int checkCollision(int temp)
+/* Targets hit in the chunk keep their points and stay down, then its entities go with the slot */
+void evictChunk (ChunkSlot& slot)
 {
-  double x_distance = pow( (projectile_x_coordinate - array_collisions[temp].x_coordinate), 2);
-  double y_distance = pow( (projectile_y_coordinate - array_collisions[temp].y_coordinate), 2);
+  if (slot.state.load() == CHUNK_RESIDENT)
+    for (int i = 0; i < slot.entityCount; i++) {
+      Entity entity = slot.entities[i];
+      if (i < slot.targetEntities && colliderOf(entity).hit) {
+        Stream.targetsHit[slot.targetIndex[i]] = true;
+        banked_score += scoreOf(entity).points;
+      }
+      despawnEntity(entity);
+    }
+  releaseChunk(slot);
+}
 
-  if ( sqrt(x_distance + y_distance) < (0.28 + 0.1) )
-    return 1;
-  else
-    return 0;
+/* Level chunks overlapping the view widened by 'margin', none if first > last */
+void chunkRange (const ViewBounds& view, float margin, int& first, int& last)
+{
+  const LevelHeader& level = Level.header;
+  first = max(levelChunkOf(view.left - margin), level.firstChunk);
+  last = min(levelChunkOf(view.right + margin), level.firstChunk + (int) level.chunkCount - 1);
+}
 
+ChunkSlot* chunkSlotOf (int chunk)
+{
+  for (int i = 0; i < CHUNK_SLOTS; i++)
+    if (Stream.slots[i].state.load() != CHUNK_FREE && Stream.slots[i].chunk == chunk)
+      return &Stream.slots[i];
+  return NULL;
 }
-int f1=0,f2=0,f3=0,f4=0,f5=0,f6=0;
 
+/* A free slot, or else one holding a chunk outside [first, last] that isn't mid load */
+ChunkSlot* slotToReuse (int first, int last)
+{
+  ChunkSlot* reuse = NULL;
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    ChunkSlot& slot = Stream.slots[i];
+    int state = slot.state.load();
+    if (state == CHUNK_FREE)
+      return &slot;
+    if (state != CHUNK_LOADING && (slot.chunk < first || slot.chunk > last))
+      reuse = &slot;
+  }
+  return reuse;
+}
 
-void draw ()
+/* Nearest the middle of the view first, for when more chunks are in range than there are slots.
+   Calls 'visit' until it returns false */
+void forChunksInRange (const ViewBounds& view, int first, int last, const function<bool(int)>& visit)
 {
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  if (first > last)
+    return;
+  int middle = min(max(levelChunkOf((view.left + view.right) / 2), first), last);
+  for (int distance = 0; middle - distance >= first || middle + distance <= last; distance++) {
+    if (middle - distance >= first && !visit(middle - distance))
+      return;
+    if (distance > 0 && middle + distance <= last && !visit(middle + distance))
+      return;
+  }
+}
 
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
+/* Bring the world in line with the view : chunks out of range are evicted, chunks coming into
+   range are given a slot and a load job, and loaded ones are spawned. With 'immediate' the
+   loads run here and everything in range is spawned before returning. The world changes, so
+   the simulation must not be ticking. True if anything was spawned or evicted */
+bool streamChunks (const ViewBounds& view, bool immediate)
+{
+  if (Stream.targetsHit.size() != Level.header.targetCount)
+    Stream.targetsHit.assign(Level.header.targetCount, false);
+  int first, last, keepFirst, keepLast;
+  chunkRange(view, CHUNK_LOAD_MARGIN, first, last);
+  chunkRange(view, CHUNK_KEEP_MARGIN, keepFirst, keepLast);
+  bool changed = false;
+
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    ChunkSlot& slot = Stream.slots[i];
+    int state = slot.state.load();
+    if ((state == CHUNK_LOADED || state == CHUNK_RESIDENT) && (slot.chunk < keepFirst || slot.chunk > keepLast)) {
+      evictChunk(slot);
+      changed = true;
+    }
+  }
 
-  // Eye - Location of camera. Don't change unless you are sure!!
-  glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-  // Target - Where is the camera looking at.  Don't change unless you are sure!!
-  glm::vec3 target (0, 0, 0);
-  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-  glm::vec3 up (0, 1, 0);
+  forChunksInRange(view, first, last, [&] (int chunk) {
+    if (chunkSlotOf(chunk))
+      return true;
+    ChunkSlot* slot = slotToReuse(first, last);
+    if (!slot)
+      return false;
+    if (slot->state.load() != CHUNK_FREE) {
+      evictChunk(*slot);
+      changed = true;
+    }
+    slot->chunk = chunk;
+    slot->state.store(CHUNK_LOADING);
+    if (immediate)
+      loadChunk(slot);
+    else
+      runJob([slot] () { loadChunk(slot); });
+    return true;
+  });
+
+  int spawned = 0;
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    ChunkSlot& slot = Stream.slots[i];
+    if (slot.state.load(memory_order_acquire) == CHUNK_LOADED && (immediate || spawned < CHUNK_SPAWNS_PER_FRAME)) {
+      spawnChunk(slot);
+      spawned++;
+      changed = true;
+    }
+  }
+  return changed;
+}
 
-  // Compute Camera matrix (view)
-  // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-  //  Don't change unless you are sure!!
-  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+/* Is there anything for streamChunks to do that needs the world */
+bool chunksPending (const ViewBounds& view)
+{
+  int first, last, keepFirst, keepLast;
+  chunkRange(view, CHUNK_LOAD_MARGIN, first, last);
+  chunkRange(view, CHUNK_KEEP_MARGIN, keepFirst, keepLast);
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    const ChunkSlot& slot = Stream.slots[i];
+    int state = slot.state.load(memory_order_acquire);
+    if (state == CHUNK_LOADED || (state == CHUNK_RESIDENT && (slot.chunk < keepFirst || slot.chunk > keepLast)))
+      return true;
+  }
+  bool pending = false;
+  forChunksInRange(view, first, last, [&] (int chunk) {
+    pending = !chunkSlotOf(chunk) && slotToReuse(first, last);
+    return !pending;
+  });
+  return pending;
+}
 
-  // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-  //  Don't change unless you are sure!!
-  glm::mat4 VP = Matrices.projection * Matrices.view;
+/* Each frame on the GL thread, after waitForRecording. The simulation is only paused when
+   there is something to spawn or evict. True if the recorded frame is out of date */
+bool streamLevel (const ViewBounds& view)
+{
+  if (!chunksPending(view))
+    return false;
+  lock_guard<mutex> paused (Sim.tickLock);
+  return streamChunks(view, false);
+}
 
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-  glm::mat4 MVP;	// MVP = Projection * View * Model
+/* The level is ending : load jobs are waited out and every slot is freed. The entities go
+   with the world */
+void releaseChunks ()
+{
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    ChunkSlot& slot = Stream.slots[i];
+    while (slot.state.load(memory_order_acquire) == CHUNK_LOADING)
+      if (!runQueuedJob(JOB_BACKGROUND))
+        this_thread::yield();
+    releaseChunk(slot);
+  }
+  arenaForget(Stream.targetsHit);
+  banked_score = 0;
+}
 
-  // Load identity to model matrix
-//  Matrices.model = glm::mat4(1.0f);
+/* Every chunk goes and those around 'view' are streamed in as if the level had just started :
+   no target is remembered as hit and nothing is banked. Only targets and barriers come from
+   chunks, so with the slots all free, streaming the same view spawns the same rows in the
+   same order. GL thread, the simulation paused */
+void restreamChunks (const ViewBounds& view)
+{
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    ChunkSlot& slot = Stream.slots[i];
+    while (slot.state.load(memory_order_acquire) == CHUNK_LOADING)
+      if (!runQueuedJob(JOB_BACKGROUND))
+        this_thread::yield();
+    evictChunk(slot);
+  }
+  Stream.targetsHit.assign(Level.header.targetCount, false);
+  banked_score = 0;
+  streamChunks(view, true);
+}
 
-  /* Render your scene */
+/* Barriers of the resident chunks, for the frame being recorded. They are numbered across
+   the slots in slot order and spread over the workers */
+void submitChunkDrawables (const ViewBounds& view)
+{
+  const ChunkSlot* resident[CHUNK_SLOTS];
+  int first[CHUNK_SLOTS + 1];   // number of the first barrier of resident[i]
+  int slots = 0;
+  first[0] = 0;
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    const ChunkSlot& slot = Stream.slots[i];
+    if (slot.state.load(memory_order_acquire) != CHUNK_RESIDENT)
+      continue;
+    resident[slots] = &slot;
+    first[slots + 1] = first[slots] + slot.barrierCount;
+    slots++;
+  }
 
-//  glm::mat4 translateTriangle = glm::translate (glm::vec3(-2.0f, 0.0f, 0.0f)); // glTranslatef
-//  glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
-//  glm::mat4 triangleTransform = translateTriangle * rotateTriangle;
-//  Matrices.model *= triangleTransform; 
-//  MVP = VP * Matrices.model; // MVP = p * V * M
+  GLuint program = ColourShader->id;
+  recordParallel (first[slots], RECORD_OBJECTS_PER_JOB, [&] (DrawList& list, int begin, int end) {
+    for (int s = 0; s < slots; s++) {
+      const ChunkSlot& slot = *resident[s];
+      for (int b = max(begin, first[s]); b < min(end, first[s + 1]); b++) {
+        const LevelBarrier& barrier = slot.barriers[b - first[s]];
+        VAO* mesh = slot.barrierMeshes[b - first[s]];
+        if (!cullObject(list, view, barrier.x, barrier.y, mesh->Radius))
+          submitDraw(list, LAYER_WORLD, program, mesh, pushTransform(list, barrier.x, barrier.y));
+      }
+    }
+  });
+}
 
-  //  Don't change unless you are sure!!
-//  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/**************************
+ * Frame pipeline         *
+ **************************/
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-//  draw3DObject(triangle);
+/* Frames go through two stages. The GL thread prepares frame N+1 (anything needing GL, such
+   as lazily built meshes, plus the camera and the snapshot), hands its recording to a job, and
+   then uploads, draws and swaps frame N while the job records. Each frame has its own
+   FrameData, and a frame is only prepared once the one recorded before it is done, so input
+   is shown at most one frame later than without the pipeline */
+struct FrameData {
+    DrawList list;
+    glm::mat4 VP;
+    ViewBounds view;
+    const Snapshot* snapshot;   // stays valid until the next acquireSnapshot, in the next prepare
+    double time;
+    int score;
+    double velocity;
+    // Each frame has a speed bar of its own : the bar of the frame being drawn must not change
+    // while the next one is prepared
+    VAO* speedbar;
+    double speedbarVelocity;    // the launch speed the bar was last built for
+};
 
-  // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
-  // glPopMatrix ();
-  
+struct FramePipeline {
+    FrameData frames[2];
+    int current;                // frame to draw next
+    mutex lock;
+    condition_variable recorded;
+    bool recording;
+} Frames;
 
-  Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translateRectangle1 = glm::translate (glm::vec3(array_collisions[1].x_coordinate, array_collisions[1].y_coordinate, 0));        // glTranslatef
-  /*if (checkCollision(1) || f1==1)
-    { 
-      f1=1;
-      // cout<<"aaa"<<endl;
-      translateRectangle1 = glm::translate (glm::vec3(100, 100, 0));
-    }*/
-  glm::mat4 rotateRectangle1 = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle1 * rotateRectangle1);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(rectangle1);
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle2 = glm::translate (glm::vec3(array_collisions[2].x_coordinate, array_collisions[2].y_coordinate, 0));        // glTranslatef
- /* if (checkCollision(2) || f2==1)
-  {
-    f2=1;
-    translateRectangle2 = glm::translate (glm::vec3(100, 100, 0));
-  }*/
-  glm::mat4 rotateRectangle2 = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle2 * rotateRectangle2);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle2);
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle3 = glm::translate (glm::vec3(array_collisions[3].x_coordinate, array_collisions[3].y_coordinate, 0));        // glTranslatef
-  /*if (checkCollision(3) || f3==1)
-  {
-    f3=1;
-    translateRectangle3 = glm::translate (glm::vec3(100, 100, 0));
-  }*/
-  glm::mat4 rotateRectangle3 = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle3 * rotateRectangle3);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle3);
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle4 = glm::translate (glm::vec3(array_collisions[4].x_coordinate, array_collisions[4].y_coordinate, 0));        // glTranslatef
-  /*if (checkCollision(4) || f4==1)
-  {
-    f4=1;
-    translateRectangle4 = glm::translate (glm::vec3(100, 100, 0));
-  }*/
-  glm::mat4 rotateRectangle4 = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle4 * rotateRectangle4);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle4);
-
-  Matrices.model = glm::mat4(1.0f);  //moving
-  glm::mat4 translateRectangle5 = glm::translate (glm::vec3(array_collisions[5].x_coordinate, array_collisions[5].y_coordinate, 0));        // glTranslatef
- 
-  /*if (checkCollision(5) || f5==1)
-  {
-    f5=1;
-    translateRectangle5 = glm::translate (glm::vec3(100, 100, 0));
-  }*/
-  glm::mat4 rotateRectangle5 = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle5 * rotateRectangle5);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle5);
-
-  Matrices.model = glm::mat4(1.0f);          //moving
-  glm::mat4 translateRectangle6 = glm::translate (glm::vec3(array_collisions[6].x_coordinate, array_collisions[6].y_coordinate, 0));        // glTranslatef
-  
-  /*if (checkCollision(6) || f6==1)
-  {
-    f6=1;
-    translateRectangle6 = glm::translate (glm::vec3(100, 100, 0));
-  }*/
-  glm::mat4 rotateRectangle6 = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle6 * rotateRectangle6);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle6);
-
-
-
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateSpeedbar = glm::translate (glm::vec3(0, -4, 0));        // glTranslatef
- // glm::mat4 rotateSpeedbar = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= translateSpeedbar; //* rotateSpeedbar);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(speedbar);
-
-
-
-/*
-  // Increment angles
-  float increments = 1;
-
-  //camera_rotation_angle++; // Simulating camera rotation
-  triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
-  rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
-*/
-
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateProjectile = glm::translate (glm::vec3(projectile_x_coordinate, projectile_y_coordinate, 0));
-  Matrices.model *= translateProjectile;
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(circle);
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translatecannon = glm::translate (glm::vec3(-3,-2,0));
-  Matrices.model *= translatecannon;
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(cannon);
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translaterectcannon = glm::translate (glm::vec3(-3, -2, 0));
-  glm::mat4 rotateRectanglePro = glm::rotate((float)(projectile_angle*M_PI/180.0f), glm::vec3(0,0,1)); 
-  Matrices.model *= (translaterectcannon*rotateRectanglePro);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(cannonrect);
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateBarrier1 = glm::translate (glm::vec3(-1, -0.5, 0));
-  glm::mat4 rotateBarrier1 = glm::rotate((float)(0*projectile_angle*M_PI/180.0f), glm::vec3(0,0,1)); 
-  Matrices.model *= (translateBarrier1*rotateBarrier1);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(barrier1);
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateBarrier2 = glm::translate (glm::vec3(1, -1, 0));
-  glm::mat4 rotateBarrier2 = glm::rotate((float)(0*projectile_angle*M_PI/180.0f), glm::vec3(0,0,1)); 
-  Matrices.model *= (translateBarrier2*rotateBarrier2);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(barrier2);
-
-
-  glm::mat4 translateTriangle[7]; 
-    // display score
-  int i;
-  for (i=1;i<=score;i++)
-  {
-    Matrices.model = glm::mat4(1.0f);
-    translateTriangle[i] = glm::translate (glm::vec3((-3+i),+3.8,0));
-    Matrices.model *= translateTriangle[i];
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    draw3DObject(triangle[i]);
+/* Everything about the frame that needs the GL thread */
+void prepareFrame (FrameData& frame)
+{
+  // Fixed camera for 2D (ortho) in XY plane
+  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
+  frame.VP = Matrices.projection * Matrices.view;
+  frame.view = currentViewBounds();
+  frame.time = glfwGetTime();
+
+  const Snapshot& snapshot = acquireSnapshot();
+  frame.snapshot = &snapshot;
+  frame.score = snapshot.score;
+  frame.velocity = snapshot.velocity;
+  // Lazily built meshes get built here, recording only looks them up
+  for (size_t i = 0; i < snapshot.meshes.size(); i++)
+    snapshot.meshes[i]();
+  if (!snapshot.preview.empty())
+    previewDotMesh();
+
+  // The simulation only changes the speed, the bar follows it here
+  if (!frame.speedbar || frame.speedbarVelocity != snapshot.velocity) {
+    frame.speedbarVelocity = snapshot.velocity;
+    createSpeedbar(frame.speedbar, frame.speedbarVelocity);
   }
+}
 
+/* The frame's draw list, without GL calls. Anything outside the view is skipped here */
+void recordFrame (FrameData& frame)
+{
+  beginRenderQueue(frame.list);
+
+  // Scenery - backdrop and cannon
+  submitStaticDrawables(frame.view);
+  // Barriers of the chunks streamed in
+  submitChunkDrawables(frame.view);
+  // Targets, barrel and projectile, as of the latest simulation tick
+  renderSystem(frame.view, *frame.snapshot, frame.time);
+  // Where the shot would go, while aiming
+  renderPreview(frame.view, *frame.snapshot);
+
+  if (!cullObject(frame.view, 0, -4, frame.speedbar->Radius))
+    submitDraw(LAYER_HUD, programID, frame.speedbar, pushTransform(0, -4));
+}
 
+void startRecording (FrameData& frame)
+{
+  {
+    lock_guard<mutex> guard (Frames.lock);
+    Frames.recording = true;
+  }
+  runJob([&frame] () {
+    recordFrame(frame);
+    lock_guard<mutex> guard (Frames.lock);
+    Frames.recording = false;
+    Frames.recorded.notify_all();
+  }, JOB_FRAME);
+}
 
+/* If every worker is busy the recording may not have started, the GL thread then records it */
+void waitForRecording ()
+{
+  unique_lock<mutex> guard (Frames.lock);
+  while (Frames.recording) {
+    guard.unlock();
+    bool ran = runQueuedJob(JOB_FRAME);
+    guard.lock();
+    if (!ran && Frames.recording)
+      Frames.recorded.wait(guard);
+  }
 }
 
-void cursorPosCallback(GLFWwindow *window, double x_position,double y_position)
+/* Draw a recorded frame. GL thread */
+void submitFrame (FrameData& frame)
 {
-//   cout<<x_position<<" "<<y_position<<endl;
+  // clear the color and depth in the frame buffer
+  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  double x_pos = x_position*(8.0f/600.0f);
-  double y_pos = y_position*(8.0f/600.0f);
+  // Transforms were pushed while recording, VP and all of them go up in one upload
+  uploadFrameUniforms(frame.VP, frame.list.transforms);
+  flushRenderQueue(frame.list);
 
-//cout<<"s "<<x_pos<<" "<<y_pos<<endl;
-  y_pos *= -1;
-  x_pos -= 1;
-  y_pos += 6;
+  // Score, level, velocity and frame rate, all in the one text draw
+  drawHud(frame.view, frame.score, frame.velocity);
+}
 
-  //cout<<x_pos<<" "<<y_pos<<endl;
+void startFramePipeline ()
+{
+  Frames.current = 0;
+  prepareFrame(Frames.frames[0]);
+  startRecording(Frames.frames[0]);
+}
 
-  // cout<< atan(y_pos/x_pos) * 180/3.14 << endl;
-  if (flag == 0)
-  {
-    projectile_angle = atan(y_pos/x_pos) * 180/3.14;
-    projectile_velocity = 0.8 * sqrt(pow( (x_pos - projectile_x_coordinate),2) + pow( (y_pos - projectile_y_coordinate), 2));  
-  }
-  createSpeedbar();
+/* One turn of the pipeline : the next frame is recorded while this one is drawn. Call after
+   waitForRecording. Changes since then that outdate the recorded frame (a restart, new
+   programs) make it be recorded again first. Returns the frame drawn */
+const FrameData& drawFrame (bool outdated)
+{
+  FrameData& frame = Frames.frames[Frames.current];
+  FrameData& next = Frames.frames[Frames.current ^ 1];
+  if (outdated)
+    recordFrame(frame);
+
+  prepareFrame(next);
+  startRecording(next);
+  submitFrame(frame);
+  Frames.current ^= 1;
+  return frame;
+}
 
+void cursorPosCallback(GLFWwindow *window, double x_position,double y_position)
+{
+  pushInput(INPUT_CURSOR, 0, 0, x_position, y_position);
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1071,8 +4479,11 @@ GLFWwindow* initGLFW (int width, int height)
     GLFWwindow* window; // window desciptor/handle
 
     glfwSetErrorCallback(error_callback);
-    if (!glfwInit()) {
-        exit(EXIT_FAILURE);
+    {
+        StartupStep step ("glfwInit");
+        if (!glfwInit()) {
+            exit(EXIT_FAILURE);
+        }
     }
 
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -1080,15 +4491,21 @@ GLFWwindow* initGLFW (int width, int height)
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-    window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
+    {
+        StartupStep step ("context creation");
+        window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
 
-    if (!window) {
-        glfwTerminate();
-        exit(EXIT_FAILURE);
-    }
+        if (!window) {
+            glfwTerminate();
+            exit(EXIT_FAILURE);
+        }
 
-    glfwMakeContextCurrent(window);
-    gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+        glfwMakeContextCurrent(window);
+    }
+    {
+        StartupStep step ("gladLoadGLLoader");
+        gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+    }
     glfwSwapInterval( 1 );
 
     /* --- register callbacks with GLFW --- */
@@ -1115,37 +4532,203 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
+/* Pick up the current program IDs and their uniforms, after a build or a reload */
+void refreshProgramHandles ()
+{
+    programID = ColourShader->id;
+    textureProgramID = TextureShader->id;
+    fontProgramID = TextShader->id;
+
+    // Hook the Camera/Transforms blocks up to our buffers and get a handle for "transformBase"
+    Matrices.TransformBaseID = bindFrameUniformBlocks(programID);
+    Matrices.TextureTransformBaseID = bindFrameUniformBlocks(textureProgramID);
+    bindFrameUniformBlocks(fontProgramID);
+}
+
+/**************************
+ * Shader hot reload      *
+ **************************/
+
+/* A watcher thread waits on inotify for the shader files to change, then rebuilds the affected
+   programs in a hidden context that shares objects with the window. Finished programs are
+   swapped in by the main thread at the next frame boundary, so a running frame never waits
+   on the compiler. A program that fails to build is dropped and the old one stays. */
+struct ShaderReload {
+    ShaderProgram* target;
+    GLuint id;
+    std::vector<std::string> files;
+};
+
+struct ShaderWatcher {
+    GLFWwindow* context;
+    std::thread thread;
+    std::atomic<bool> quitting;
+    int inotifyFd;
+    std::map<int, std::string> directories;  // watch descriptor -> directory prefix of its files
+
+    std::mutex lock;                         // guards the programs' file lists and 'ready'
+    std::vector<ShaderProgram*> programs;
+    std::vector<ShaderReload> ready;
+} Watcher;
+
+void rebuildChangedPrograms (const std::vector<std::string>& changed)
+{
+    for (size_t i = 0; i < Watcher.programs.size(); i++) {
+        ShaderProgram* program = Watcher.programs[i];
+        // Only the inputs of the build are copied, under the lock : the main thread swaps the
+        // program's files and id in applyShaderReloads, and its id is never read here
+        ShaderProgram build = ShaderProgram();
+        bool affected = false;
+        {
+            std::lock_guard<std::mutex> guard (Watcher.lock);
+            for (size_t f = 0; f < program->files.size() && !affected; f++)
+                affected = std::find(changed.begin(), changed.end(), program->files[f]) != changed.end();
+            build.vertexPath = program->vertexPath;
+            build.fragmentPath = program->fragmentPath;
+            build.defines = program->defines;
+        }
+        if (!affected)
+            continue;
+
+        submitShaderProgram(&build, false);
+        bool ok = finishShaderProgram(&build, false);
+        // The program must be complete before the main context uses it
+        glFinish();
+
+        if (!ok) {
+            printf("Reload of %s + %s failed, keeping the previous program\n", program->vertexPath, program->fragmentPath);
+            glDeleteProgram(build.id);
+            continue;
+        }
+        ShaderReload reload = { program, build.id, build.files };
+        std::lock_guard<std::mutex> guard (Watcher.lock);
+        Watcher.ready.push_back (reload);
+    }
+}
+
+void shaderWatchLoop ()
+{
+    glfwMakeContextCurrent (Watcher.context);
+
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd events = { Watcher.inotifyFd, POLLIN, 0 };
+    while (!Watcher.quitting) {
+        if (poll(&events, 1, 250) <= 0)
+            continue;
+
+        // Editors often save in several steps, collect until the directory has been quiet for a moment
+        std::vector<std::string> changed;
+        do {
+            ssize_t length = read (Watcher.inotifyFd, buffer, sizeof(buffer));
+            for (char* at = buffer; length > 0 && at < buffer + length; ) {
+                struct inotify_event* event = (struct inotify_event*) at;
+                if (event->len)
+                    changed.push_back (Watcher.directories[event->wd] + event->name);
+                at += sizeof(struct inotify_event) + event->len;
+            }
+        } while (!Watcher.quitting && poll(&events, 1, 50) > 0);
+
+        rebuildChangedPrograms(changed);
+    }
+
+    glfwMakeContextCurrent (NULL);
+}
+
+/* Watch the directories of every file the programs were built from. Call from the main thread */
+void startShaderHotReload (GLFWwindow* window, const std::vector<ShaderProgram*>& programs)
+{
+    Watcher.inotifyFd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (Watcher.inotifyFd < 0) {
+        perror ("Shader hot reload disabled, inotify_init1");
+        return;
+    }
+
+    Watcher.programs = programs;
+    for (size_t i = 0; i < programs.size(); i++)
+        for (size_t f = 0; f < programs[i]->files.size(); f++) {
+            std::string prefix = directoryOf(programs[i]->files[f]);
+            // Saving through a temporary file and rename shows up as IN_MOVED_TO
+            int wd = inotify_add_watch (Watcher.inotifyFd, prefix.empty() ? "." : prefix.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd >= 0)
+                Watcher.directories[wd] = prefix;
+        }
+
+    // Windows and contexts can only be created on the main thread
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    Watcher.context = glfwCreateWindow(1, 1, "Shader reload", NULL, window);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    if (!Watcher.context) {
+        fprintf(stderr, "Shader hot reload disabled, no shared context\n");
+        close (Watcher.inotifyFd);
+        Watcher.inotifyFd = -1;
+        return;
+    }
+
+    Watcher.quitting = false;
+    Watcher.thread = std::thread(shaderWatchLoop);
+}
+
+void stopShaderHotReload ()
+{
+    if (!Watcher.thread.joinable())
+        return;
+    Watcher.quitting = true;
+    Watcher.thread.join();
+    close (Watcher.inotifyFd);
+    glfwDestroyWindow (Watcher.context);
+}
+
+/* Swap in programs the watcher finished since the last frame. Call between frames.
+   True if any program changed */
+bool applyShaderReloads ()
+{
+    std::vector<ShaderReload> ready;
+    {
+        std::lock_guard<std::mutex> guard (Watcher.lock);
+        if (Watcher.ready.empty())
+            return false;
+        ready.swap (Watcher.ready);
+
+        for (size_t i = 0; i < ready.size(); i++)
+            ready[i].target->files = ready[i].files;
+    }
+
+    for (size_t i = 0; i < ready.size(); i++) {
+        glDeleteProgram (ready[i].target->id);
+        ready[i].target->id = ready[i].id;
+        printf("Reloaded %s + %s\n", ready[i].target->vertexPath, ready[i].target->fragmentPath);
+    }
+    refreshProgramHandles();
+    stateInvalidate();
+    return true;
+}
+
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
 {
-    /* Objects should be created before any other gl function and shaders */
-	// Create the models
-//	createTriangle (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
-  createRectangle (1);
-  createRectangle (2);
-  createRectangle (3);
-  createRectangle (4);
-  createRectangle (5);
-	createRectangle (6);
-
-  createSpeedbar();
-	
-  createCircle();
+    // Nothing is known to be bound yet, so the first use of each binding goes to GL
+    stateInvalidate ();
+
+	// Programs go to the driver first so they compile while the rest of initGL runs.
+	// They are only waited for right before the first frame draws
+	std::vector<ShaderProgram*> programs;
+	programs.push_back(ColourShader = newShaderProgram("Sample_GL.vert", "Sample_GL.frag"));
+	programs.push_back(TextureShader = newShaderProgram("TextureRender.vert", "TextureRender.frag"));
+	programs.push_back(TextShader = newShaderProgram("fontrender.vert", "fontrender.frag"));
+	submitShaderPrograms(programs);
+	createFrameUniforms();
+
+	// Create the models. Targets, projectile, barrel and speed bar are made on first use in draw()
   createCannon();
-  createCannonRectangle ();
-  createBarrier(1);
-  createBarrier2(2);
 
+  createBackdrop();
+  spawnLevel();
 
-  for(int i=1;i<=6;i++)
-    createTriangle(i);
-
-
-	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Rebuild programs in the background whenever their files change. Shaders read from the
+	// asset pack would ignore those edits, so only when running from loose files
+	if (!Assets.data)
+		startShaderHotReload(window, programs);
 
 	
 	reshapeWindow (window, width, height);
@@ -1163,27 +4746,17 @@ void initGL (GLFWwindow* window, int width, int height)
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
-int f[7]={};
-void changeXVelocity()
+/* Print the per-frame counters about once a second while stats are toggled on (P) */
+double last_stats_time = 0;
+void printFrameStats (double current_time, const DrawList& frame)
 {
+  if (!show_stats || current_time - last_stats_time < 1.0)
+    return;
+  last_stats_time = current_time;
 
-  int i;
-  for (i=1;i<=6;i++)
-  {
-   if ( checkCollision(i)==1 )
-    {
-      if (f[i] != 1)
-      {
-        array_collisions[i].x_velocity=projectile_x_velocity*(1/3); // conservation of momentum area of circle =0.35 area of rect = 0.16
-                                                                   // also accounts for energy lost during collision
-
-        array_collisions[i].collided=1;
-        projectile_x_velocity=-projectile_x_velocity*0.8;
-        f[i]=1;
-        break;
-      }
-   }  
-  }
+  cout << "GL state calls: " << GLState.issued << " issued, " << GLState.elided << " elided" << endl;
+  cout << "Render queue: " << Queue.submitted << " commands, " << Queue.batches << " draws" << endl;
+  cout << "Culling: " << frame.culled << " of " << frame.tested << " objects outside the view" << endl;
 }
 
 int main (int argc, char** argv)
@@ -1191,83 +4764,76 @@ int main (int argc, char** argv)
 	int width = 600;
 	int height = 600;
 
-  array_collisions[1].x_coordinate=0; array_collisions[1].y_coordinate=0; 
-  array_collisions[2].x_coordinate=0; array_collisions[2].y_coordinate=2.0; 
-  array_collisions[3].x_coordinate=-1; array_collisions[3].y_coordinate=3.0; 
-  array_collisions[4].x_coordinate=2.5; array_collisions[4].y_coordinate=-1; 
-  array_collisions[5].x_coordinate=2.5; array_collisions[5].y_coordinate=2.0; 
-  array_collisions[6].x_coordinate=3.5; array_collisions[6].y_coordinate=1.0;
+    Startup.origin = startupClock();
+
+    // One mapping for every asset, if the pack has been built
+    {
+        StartupStep step ("openAssetPack");
+        openAssetPack(ASSET_PACK_PATH);
+    }
+    // A level name (without extension) may be given on the command line
+    if (!loadLevel(argc > 1 ? argv[1] : LEVEL_NAME))
+        exit(EXIT_FAILURE);
+    startWorkers();
+    // Read once, before the simulation thread starts
+    physics_tuned = physics_tuning.parse(getenv("PHYSICS_TUNING"));
 
     GLFWwindow* window = initGLFW(width, height);
 
-	initGL (window, width, height);
+    {
+        StartupStep step ("initGL");
+        initGL (window, width, height);
+    }
+    StartupStep* first_frame = new StartupStep ("first frame");
 
-    double last_update_time = glfwGetTime(), current_time;
+    // Physics and input from here on run on the simulation thread
+    startSimulation();
+    // Frame 0 starts recording, each turn of the loop draws one and records the next
+    startFramePipeline();
 
     /* Draw in loop */
     while (!glfwWindowShouldClose(window)) {
     reshapeWindow (window, width, height);
 
-        
-        for (int i=1;i<=6;i++)
-          if (array_collisions[i].collided == 1)
-            score++;
+        // Nothing below may change while a frame is being recorded
+        waitForRecording();
+
+        // A level restart asked for by input, done between ticks
+        bool outdated = applyRestartRequest();
+        // Chunks of the level coming into range of the view, or left behind
+        outdated |= streamLevel(currentViewBounds());
+        // Programs rebuilt by the watcher are swapped in between frames
+        outdated |= applyShaderReloads();
+        // Continue streaming textures that finished decoding
+        pumpTextureUploads();
+
+        // Programs submitted in initGL are waited for here, when the first frame needs them
+        if (finishShaderPrograms()) {
+            refreshProgramHandles();
+            outdated = true;
+        }
 
         // OpenGL Draw commands
-        draw();
-        score=0;
+        stateResetCounters();
+        const FrameData& drawn = drawFrame(outdated);
+        printFrameStats(glfwGetTime(), drawn.list);
         // Swap Frame Buffer in double buffering
         glfwSwapBuffers(window);
 
-        // Poll for Keyboard and mouse events
-        glfwPollEvents();
-
-        // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-        current_time = glfwGetTime(); // Time in seconds
-        double delay=0.01;
-        if ((current_time - last_update_time) >= delay) { // atleast 0.5s elapsed since last frame
-            // do something every 0.5 seconds ..
-            if (flag==1){
-              projectile_x_velocity *= air_resistance;
-              projectile_y_velocity -= gravity;
-            }
-
-            if (projectile_y_coordinate < -2)
-              projectile_y_velocity =- projectile_y_velocity*bounce; 
-
-            checkCollisionBarrier();
-            changeXVelocity();
-
-            projectile_x_coordinate += (projectile_x_velocity * delay);
-            projectile_y_coordinate += (projectile_y_velocity * delay);  
-
-            for (int i=1;i<=6;i++)
-            {
-              if(checkCollision(i) || array_collisions[i].collided==1)
-              {
-                array_collisions[i].collided=1;
-              //  cout<<"a"<<endl;
-                array_collisions[i].x_coordinate += (0.01);
-            //    cout<<array_collisions[i].x_coordinate<<"c"<<endl;
-                array_collisions[i].y_coordinate -= (0.05);
-              }
-              if (i > 4)
-                array_collisions[i].x_coordinate += 0.005; 
-            }
-          
-            int i;
-            for (i=5;i<7;i++)
-            {
-              array_collisions[i].x_coordinate += (level/100);
-              if (array_collisions[i].x_coordinate > 4)
-                array_collisions[i].x_coordinate = -4;
-
-            }
-
-            last_update_time = current_time;
+        if (first_frame) {
+            delete first_frame;
+            first_frame = NULL;
+            reportStartup();
         }
+
+        // Poll for Keyboard and mouse events, they are queued for the simulation
+        glfwPollEvents();
     }
 
+    waitForRecording();
+    stopSimulation();
+    stopShaderHotReload();
+    stopWorkers();
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
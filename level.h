@@ -0,0 +1,249 @@
+/* Level files, shared by the game and mklevel.
+
+   Levels are authored as text (levels/level1.txt) :
+
+     # comment
+     cannon x y                              where the projectile starts
+     barrier x y left bottom right top       box relative to (x, y)
+     target x y [drift [points]]             drift : units per second to the right, wrapping round
+
+   and compiled by mklevel into the form the game maps :
+
+     LevelHeader
+     LevelChunk[chunkCount]
+     LevelTarget[targetCount]
+     LevelBarrier[barrierCount]
+
+   each array starting on a LEVEL_ALIGN boundary. The header refers to the arrays by file
+   offset; levelFixup checks those against the file and turns them into pointers, and the
+   arrays are then read where they were mapped.
+
+   The world is cut into chunks LEVEL_CHUNK_WIDTH wide, chunk 0 being the original field
+   from -4 to 4. Targets and barriers are stored grouped by the chunk their x falls in, and
+   each LevelChunk gives its ranges of both arrays, so the game can stream a long level a
+   chunk at a time. chunks[0] is chunk firstChunk, and every chunk up to the last one used
+   has an entry, empty or not. */
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define LEVEL_MAGIC 0x314c564c   // "LVL1"
+#define LEVEL_VERSION 2
+#define LEVEL_ALIGN 16
+#define LEVEL_CHUNK_WIDTH 8.0f
+#define LEVEL_CHUNK_ORIGIN -4.0f   // left edge of chunk 0
+
+struct LevelTarget {
+    float x, y;
+    float drift;
+    int32_t points;
+};
+
+struct LevelBarrier {
+    float x, y;
+    float left, bottom, right, top;
+};
+
+struct LevelChunk {
+    uint32_t firstTarget, targetCount;
+    uint32_t firstBarrier, barrierCount;
+};
+
+/* File offset on disk, pointer once fixed up */
+template <typename T>
+union LevelRef {
+    uint64_t offset;
+    T* pointer;
+};
+
+struct LevelHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t targetCount;
+    uint32_t barrierCount;
+    float cannonX, cannonY;
+    int32_t firstChunk;
+    uint32_t chunkCount;
+    uint64_t size;                          // of the whole file
+    LevelRef<const LevelTarget> targets;
+    LevelRef<const LevelBarrier> barriers;
+    LevelRef<const LevelChunk> chunks;
+};
+
+inline int levelChunkOf (float x)
+{
+    return (int) floorf((x - LEVEL_CHUNK_ORIGIN) / LEVEL_CHUNK_WIDTH);
+}
+
+inline float levelChunkLeft (int chunk)
+{
+    return LEVEL_CHUNK_ORIGIN + chunk * LEVEL_CHUNK_WIDTH;
+}
+
+inline uint64_t levelAlign (uint64_t offset)
+{
+    return (offset + LEVEL_ALIGN - 1) & ~(uint64_t) (LEVEL_ALIGN - 1);
+}
+
+/* Copy of the header of 'data' with its references pointing into 'data'. False for anything
+   that isn't a whole level of this version, so nothing reads past the end */
+inline bool levelFixup (const void* data, size_t size, LevelHeader& level)
+{
+    if (size < sizeof(LevelHeader) || (uintptr_t) data % LEVEL_ALIGN != 0)
+        return false;
+    memcpy (&level, data, sizeof(level));
+    if (level.magic != LEVEL_MAGIC || level.version != LEVEL_VERSION || level.size != size)
+        return false;
+
+    uint64_t targetsEnd = level.targets.offset + (uint64_t) level.targetCount * sizeof(LevelTarget);
+    uint64_t barriersEnd = level.barriers.offset + (uint64_t) level.barrierCount * sizeof(LevelBarrier);
+    uint64_t chunksEnd = level.chunks.offset + (uint64_t) level.chunkCount * sizeof(LevelChunk);
+    if (level.targets.offset % LEVEL_ALIGN || level.barriers.offset % LEVEL_ALIGN || level.chunks.offset % LEVEL_ALIGN
+        || level.targets.offset < sizeof(LevelHeader) || targetsEnd > size
+        || level.barriers.offset < sizeof(LevelHeader) || barriersEnd > size
+        || level.chunks.offset < sizeof(LevelHeader) || chunksEnd > size)
+        return false;
+
+    const unsigned char* base = (const unsigned char*) data;
+    level.targets.pointer = (const LevelTarget*) (base + level.targets.offset);
+    level.barriers.pointer = (const LevelBarrier*) (base + level.barriers.offset);
+    level.chunks.pointer = (const LevelChunk*) (base + level.chunks.offset);
+
+    // The chunk table is what the game indexes by, one entry per chunk is cheap to check
+    for (uint32_t i = 0; i < level.chunkCount; i++) {
+        const LevelChunk& chunk = level.chunks.pointer[i];
+        if ((uint64_t) chunk.firstTarget + chunk.targetCount > level.targetCount
+            || (uint64_t) chunk.firstBarrier + chunk.barrierCount > level.barrierCount)
+            return false;
+    }
+    return true;
+}
+
+template <typename T>
+inline bool levelChunkBefore (const T& a, const T& b)
+{
+    return levelChunkOf(a.x) < levelChunkOf(b.x);
+}
+
+/* Each chunk's range of 'items', which are sorted by chunk */
+template <typename T>
+inline void levelChunkRanges (const std::vector<T>& items, int firstChunk, std::vector<LevelChunk>& chunks,
+                              uint32_t LevelChunk::* first, uint32_t LevelChunk::* count)
+{
+    for (size_t i = 0; i < items.size(); i++) {
+        LevelChunk& chunk = chunks[levelChunkOf(items[i].x) - firstChunk];
+        if (chunk.*count == 0)
+            chunk.*first = i;
+        chunk.*count += 1;
+    }
+}
+
+/* Binary form of the arrays, laid out as described above. Targets and barriers keep their
+   order within a chunk */
+inline void writeLevel (float cannonX, float cannonY, std::vector<LevelTarget> targets,
+                        std::vector<LevelBarrier> barriers, std::vector<unsigned char>& out)
+{
+    std::stable_sort (targets.begin(), targets.end(), levelChunkBefore<LevelTarget>);
+    std::stable_sort (barriers.begin(), barriers.end(), levelChunkBefore<LevelBarrier>);
+    int firstChunk = 0, lastChunk = -1;
+    if (!targets.empty() || !barriers.empty()) {
+        firstChunk = std::min(targets.empty() ? INT32_MAX : levelChunkOf(targets.front().x),
+                              barriers.empty() ? INT32_MAX : levelChunkOf(barriers.front().x));
+        lastChunk = std::max(targets.empty() ? INT32_MIN : levelChunkOf(targets.back().x),
+                             barriers.empty() ? INT32_MIN : levelChunkOf(barriers.back().x));
+    }
+    LevelChunk empty = { 0, 0, 0, 0 };
+    std::vector<LevelChunk> chunks (lastChunk - firstChunk + 1, empty);
+    levelChunkRanges (targets, firstChunk, chunks, &LevelChunk::firstTarget, &LevelChunk::targetCount);
+    levelChunkRanges (barriers, firstChunk, chunks, &LevelChunk::firstBarrier, &LevelChunk::barrierCount);
+
+    LevelHeader header;
+    memset (&header, 0, sizeof(header));
+    header.magic = LEVEL_MAGIC;
+    header.version = LEVEL_VERSION;
+    header.targetCount = targets.size();
+    header.barrierCount = barriers.size();
+    header.cannonX = cannonX;
+    header.cannonY = cannonY;
+    header.firstChunk = firstChunk;
+    header.chunkCount = chunks.size();
+    header.chunks.offset = levelAlign(sizeof(header));
+    header.targets.offset = levelAlign(header.chunks.offset + chunks.size() * sizeof(LevelChunk));
+    header.barriers.offset = levelAlign(header.targets.offset + targets.size() * sizeof(LevelTarget));
+    header.size = header.barriers.offset + barriers.size() * sizeof(LevelBarrier);
+
+    out.assign (header.size, 0);
+    memcpy (&out[0], &header, sizeof(header));
+    if (!chunks.empty())
+        memcpy (&out[header.chunks.offset], &chunks[0], chunks.size() * sizeof(LevelChunk));
+    if (!targets.empty())
+        memcpy (&out[header.targets.offset], &targets[0], targets.size() * sizeof(LevelTarget));
+    if (!barriers.empty())
+        memcpy (&out[header.barriers.offset], &barriers[0], barriers.size() * sizeof(LevelBarrier));
+}
+
+/* Text form to binary form. On a bad line, false with 'error' naming it */
+inline bool compileLevel (const char* text, size_t size, std::vector<unsigned char>& out, std::string& error)
+{
+    std::vector<LevelTarget> targets;
+    std::vector<LevelBarrier> barriers;
+    float cannonX = -3, cannonY = -2;
+
+    std::string source (text, size);
+    int lineNumber = 0;
+    for (size_t start = 0; start < source.size(); ) {
+        size_t end = source.find('\n', start);
+        if (end == std::string::npos)
+            end = source.size();
+        std::string line = source.substr(start, end - start);
+        start = end + 1;
+        lineNumber++;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.resize (hash);
+
+        char keyword[16];
+        float v[6];
+        int fields = sscanf(line.c_str(), "%15s %f %f %f %f %f %f", keyword, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]);
+        if (fields <= 0)
+            continue;
+
+        bool ok = true;
+        if (!strcmp(keyword, "cannon") && fields == 3) {
+            cannonX = v[0];
+            cannonY = v[1];
+        }
+        else if (!strcmp(keyword, "barrier") && fields == 7) {
+            LevelBarrier barrier = { v[0], v[1], v[2], v[3], v[4], v[5] };
+            ok = barrier.left < barrier.right && barrier.bottom < barrier.top;
+            barriers.push_back (barrier);
+        }
+        else if (!strcmp(keyword, "target") && fields >= 3 && fields <= 5) {
+            LevelTarget target = { v[0], v[1], fields > 3 ? v[2] : 0, fields > 4 ? (int32_t) v[3] : 1 };
+            targets.push_back (target);
+        }
+        else
+            ok = false;
+
+        if (!ok) {
+            char where[32];
+            snprintf (where, sizeof(where), "line %d: ", lineNumber);
+            error = where + line;
+            return false;
+        }
+    }
+
+    writeLevel (cannonX, cannonY, targets, barriers, out);
+    return true;
+}
+
+#endif
@@ -0,0 +1,115 @@
+/* mklevel : compiles a text level into the binary form the game maps (see level.h).
+
+   mklevel level.txt level.lvl          compile
+   mklevel -random count level.lvl [chunks]
+                                        that many scattered targets behind the usual
+                                        barriers, over that many chunks (1), for timing
+                                        the loader and the streaming */
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "level.h"
+
+using namespace std;
+
+bool readWhole (const char* path, string& text)
+{
+    FILE* in = fopen(path, "rb");
+    if (!in)
+        return false;
+    char buffer[65536];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0)
+        text.append (buffer, got);
+    bool ok = ferror(in) == 0;
+    fclose(in);
+    return ok;
+}
+
+// Written beside the target and renamed over it, so the game never maps half a level
+bool writeWhole (const char* path, const vector<unsigned char>& data)
+{
+    string temp = string(path) + ".tmp";
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (!out) {
+        perror(temp.c_str());
+        return false;
+    }
+    bool written = fwrite(&data[0], 1, data.size(), out) == data.size();
+    written = fclose(out) == 0 && written;
+    if (!written || rename(temp.c_str(), path) != 0) {
+        fprintf(stderr, "could not write %s\n", path);
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+int compile (const char* input, const char* output)
+{
+    string text, error;
+    if (!readWhole(input, text)) {
+        fprintf(stderr, "%s: cannot read\n", input);
+        return 1;
+    }
+    vector<unsigned char> level;
+    if (!compileLevel(text.data(), text.size(), level, error)) {
+        fprintf(stderr, "%s: %s\n", input, error.c_str());
+        return 1;
+    }
+    if (!writeWhole(output, level))
+        return 1;
+
+    const LevelHeader* header = (const LevelHeader*) &level[0];
+    printf("%s -> %s : %u targets, %u barriers, %u chunks, %u bytes\n", input, output,
+           header->targetCount, header->barrierCount, header->chunkCount, (unsigned) level.size());
+    return 0;
+}
+
+int randomLevel (int count, int chunks, const char* output)
+{
+    vector<LevelTarget> targets (count);
+    srand(count);
+    for (int i = 0; i < count; i++) {
+        targets[i].x = LEVEL_CHUNK_ORIGIN + chunks * LEVEL_CHUNK_WIDTH * rand() / (RAND_MAX + 1.0f);
+        targets[i].y = -1.5f + 5.5f * rand() / RAND_MAX;
+        targets[i].drift = i % 3 == 0 ? 0.5f + 2.0f * rand() / RAND_MAX : 0;
+        targets[i].points = 1;
+    }
+    vector<LevelBarrier> barriers;
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        float x = chunk * LEVEL_CHUNK_WIDTH;
+        LevelBarrier tall = { x - 1, -0.5, -0.2, -1.7, 0.2, 1.5 }, little = { x + 1, -1, -0.2, -1.2, 0.2, 1.0 };
+        barriers.push_back (tall);
+        barriers.push_back (little);
+    }
+
+    vector<unsigned char> level;
+    writeLevel (-3, -2, targets, barriers, level);
+    if (!writeWhole(output, level))
+        return 1;
+
+    // The game's load is a map and levelFixup, time the part that isn't the OS
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    LevelHeader header;
+    bool valid = levelFixup(&level[0], level.size(), header);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    printf("%s : %d targets, %d chunks, %u bytes, fix-up %s in %.3f ms\n", output, count, chunks,
+           (unsigned) level.size(), valid ? "ok" : "FAILED", ms);
+    return valid ? 0 : 1;
+}
+
+int main (int argc, char** argv)
+{
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "-random") == 0)
+        return randomLevel(atoi(argv[2]), argc == 5 ? max(1, atoi(argv[4])) : 1, argv[3]);
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s level.txt level.lvl\n       %s -random count level.lvl [chunks]\n", argv[0], argv[0]);
+        return 2;
+    }
+    return compile(argv[1], argv[2]);
+}
@@ -0,0 +1,161 @@
+/* mkpack : builds the asset pack the game maps at startup (see assetpack.h).
+
+   mkpack assets.pak file ...     pack the files, names as given
+   mkpack -l assets.pak           list a pack and check every checksum */
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "assetpack.h"
+
+using namespace std;
+
+struct PackFile {
+    string name;
+    vector<unsigned char> data;
+    AssetEntry entry;
+};
+
+bool readWhole (const char* path, vector<unsigned char>& data)
+{
+    FILE* in = fopen(path, "rb");
+    if (!in)
+        return false;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size >= 0 && fread(data.empty() ? NULL : &data[0], 1, data.size(), in) == data.size();
+    fclose(in);
+    return ok;
+}
+
+bool byHash (const PackFile& a, const PackFile& b)
+{
+    return a.entry.hash < b.entry.hash;
+}
+
+uint64_t align (uint64_t offset)
+{
+    return (offset + ASSET_ALIGN - 1) & ~(uint64_t) (ASSET_ALIGN - 1);
+}
+
+int build (const char* output, int count, char** names)
+{
+    vector<PackFile> files (count);
+    for (int i = 0; i < count; i++) {
+        PackFile& file = files[i];
+        file.name = names[i];
+        if (!readWhole(names[i], file.data)) {
+            fprintf(stderr, "%s: cannot read\n", names[i]);
+            return 1;
+        }
+        memset(&file.entry, 0, sizeof(file.entry));
+        file.entry.hash = assetHash(names[i]);
+        file.entry.size = file.data.size();
+        file.entry.type = assetTypeOf(names[i]);
+        file.entry.checksum = assetChecksum(file.data.empty() ? NULL : &file.data[0], file.data.size());
+    }
+
+    sort(files.begin(), files.end(), byHash);
+    for (int i = 1; i < count; i++)
+        if (files[i].entry.hash == files[i-1].entry.hash) {
+            fprintf(stderr, "%s and %s have the same hash%s\n", files[i-1].name.c_str(), files[i].name.c_str(),
+                    files[i].name == files[i-1].name ? " (listed twice)" : ", rename one");
+            return 1;
+        }
+
+    // Names, then the data, in hash order
+    string names_table;
+    for (int i = 0; i < count; i++) {
+        files[i].entry.nameOffset = names_table.size();
+        names_table += files[i].name;
+        names_table += '\0';
+    }
+
+    AssetPackHeader header;
+    header.magic = ASSET_PACK_MAGIC;
+    header.version = ASSET_PACK_VERSION;
+    header.count = count;
+    header.namesSize = names_table.size();
+    header.namesOffset = sizeof(header) + count * sizeof(AssetEntry);
+
+    uint64_t offset = header.namesOffset + header.namesSize;
+    for (int i = 0; i < count; i++) {
+        offset = align(offset);
+        files[i].entry.offset = offset;
+        offset += files[i].entry.size;
+    }
+
+    // Written beside the target and renamed over it, so the game never maps half a pack
+    string temp = string(output) + ".tmp";
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (!out) {
+        perror(temp.c_str());
+        return 1;
+    }
+    static const unsigned char zeros[ASSET_ALIGN] = { 0 };
+    fwrite(&header, sizeof(header), 1, out);
+    for (int i = 0; i < count; i++)
+        fwrite(&files[i].entry, sizeof(AssetEntry), 1, out);
+    fwrite(names_table.data(), 1, names_table.size(), out);
+    for (int i = 0; i < count; i++) {
+        fwrite(zeros, 1, files[i].entry.offset - ftell(out), out);
+        if (!files[i].data.empty())
+            fwrite(&files[i].data[0], 1, files[i].data.size(), out);
+    }
+    bool written = ferror(out) == 0;
+    written = fclose(out) == 0 && written;
+    if (!written || rename(temp.c_str(), output) != 0) {
+        fprintf(stderr, "could not write %s\n", output);
+        remove(temp.c_str());
+        return 1;
+    }
+
+    printf("%s: %d assets, %llu bytes\n", output, count, (unsigned long long) offset);
+    return 0;
+}
+
+int list (const char* path)
+{
+    vector<unsigned char> pack;
+    if (!readWhole(path, pack) || pack.size() < sizeof(AssetPackHeader)) {
+        fprintf(stderr, "%s: cannot read\n", path);
+        return 1;
+    }
+    const AssetPackHeader* header = (const AssetPackHeader*) &pack[0];
+    if (header->magic != ASSET_PACK_MAGIC || header->version != ASSET_PACK_VERSION
+        || header->namesOffset + header->namesSize > pack.size()) {
+        fprintf(stderr, "%s: not an asset pack\n", path);
+        return 1;
+    }
+
+    static const char* types[] = { "raw", "shader", "image", "font", "texture cache", "level" };
+    const AssetEntry* entries = (const AssetEntry*) (header + 1);
+    const char* names = (const char*) &pack[header->namesOffset];
+    int bad = 0;
+    for (uint32_t i = 0; i < header->count; i++) {
+        const AssetEntry& entry = entries[i];
+        bool ok = entry.offset + entry.size <= pack.size()
+               && assetChecksum(&pack[0] + entry.offset, entry.size) == entry.checksum;
+        bad += !ok;
+        printf("%016llx %10llu  %-14s %s%s\n", (unsigned long long) entry.hash, (unsigned long long) entry.size,
+               entry.type < 6 ? types[entry.type] : "?", names + entry.nameOffset, ok ? "" : "  CHECKSUM MISMATCH");
+    }
+    return bad ? 1 : 0;
+}
+
+int main (int argc, char** argv)
+{
+    if (argc == 3 && strcmp(argv[1], "-l") == 0)
+        return list(argv[2]);
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s pack file ...\n       %s -l pack\n", argv[0], argv[0]);
+        return 2;
+    }
+    return build(argv[1], argc - 2, argv + 2);
+}
@@ -0,0 +1,90 @@
+/* physbench : times the shot tick the game traces its aim preview with (stepShot in
+   physics.h), with the parameters fixed at compile time against the same tick reading them
+   at run time.
+
+   physbench [barriers [traces [air_resistance gravity bounce]]]
+
+   Each trace is one aim, stepped for as many ticks as a preview path takes. The run time
+   values come from the command line, so the compiler cannot fold them in */
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <chrono>
+
+#include "physics.h"
+
+using namespace std;
+
+// As in game.cpp
+#define GROUND_LEVEL -2.0f
+#define SIMULATION_STEP 0.01f
+#define SHOT_RADIUS 0.1f
+#define TRACE_TICKS (40 * 6)   // PREVIEW_DOTS * PREVIEW_DOT_TICKS
+
+/* Barriers of the usual size scattered over the right of the screen, grown by the shot's radius */
+vector<ShotBarrier> scatterBarriers (int count)
+{
+    vector<ShotBarrier> barriers (count);
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        float x = -1 + 5.0f * rand() / RAND_MAX, y = -2 + 4.0f * rand() / RAND_MAX;
+        ShotBarrier box = { x - 0.1f - SHOT_RADIUS, x + 0.1f + SHOT_RADIUS, y - 0.5f - SHOT_RADIUS, y + 0.5f + SHOT_RADIUS };
+        barriers[i] = box;
+    }
+    return barriers;
+}
+
+/* Nanoseconds per tick over 'traces' aims swept across angles and speeds. 'end' gets where the
+   last shot of each aim ended up, to compare the two runs */
+template <typename Physics>
+double run (const Physics& physics, const vector<ShotBarrier>& barriers, int traces, vector<float>& end)
+{
+    end.resize(2 * traces);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int t = 0; t < traces; t++) {
+        float angle = (t % 180) * 0.5f * (float) DEGREES_TO_RADIANS, speed = 1 + (t / 180 % 100) * 0.05f;
+        float x = -3, y = -1.5f, vx = speed * cos(angle), vy = speed * sin(angle);
+        for (int tick = 0; tick < TRACE_TICKS; tick++)
+            stepShot(physics, x, y, vx, vy, barriers.data(), barriers.size(), GROUND_LEVEL, SIMULATION_STEP);
+        end[2*t] = x;
+        end[2*t + 1] = y;
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    return ns / ((double) traces * TRACE_TICKS);
+}
+
+int main (int argc, char** argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 16;
+    int traces = argc > 2 ? atoi(argv[2]) : 20000;
+    RuntimePhysics runtime;
+    if (argc > 5) {
+        runtime.airResistance = atof(argv[3]);
+        runtime.gravity = atof(argv[4]);
+        runtime.bounce = atof(argv[5]);
+    }
+    else if (argc != 1 && argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: %s [barriers [traces [air_resistance gravity bounce]]]\n", argv[0]);
+        return 2;
+    }
+    if (count < 0 || traces <= 0) {
+        fprintf(stderr, "nothing to time\n");
+        return 2;
+    }
+
+    vector<ShotBarrier> barriers = scatterBarriers(count);
+    vector<float> tuned, tuning;
+    double tunedTime = run(TunedPhysics(), barriers, traces, tuned);
+    double tuningTime = run(runtime, barriers, traces, tuning);
+
+    // With the default values both must have traced the same paths
+    bool same = argc > 3 || tuned == tuning;
+
+    printf("%d barriers, %d traces of %d ticks\n", count, traces, TRACE_TICKS);
+    printf("  compile time parameters  %7.3f ns per tick  (%.1f us per trace)\n", tunedTime, tunedTime * TRACE_TICKS / 1000);
+    printf("  run time parameters      %7.3f ns per tick  (%.2fx)\n", tuningTime, tuningTime / tunedTime);
+    if (!same)
+        printf("  RESULTS DIFFER\n");
+    return same ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+/* Projectile physics, shared by the game and physbench.
+
+   The step is written once, as templates over a parameter policy :
+
+     TunedPhysics     the game's values as compile time constants, so each step is
+                      specialised with them folded in
+     RuntimePhysics   the same values as plain members, for tuning without a rebuild
+
+   Both are passed as objects; the constants of TunedPhysics are read through the object
+   just like the members of RuntimePhysics, so the step code doesn't change between them. */
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Angle conversions, with the game's long standing 3.14 for pi so aiming feels the same
+constexpr double DEGREES_TO_RADIANS = 3.14 / 180;
+constexpr double RADIANS_TO_DEGREES = 180 / 3.14;
+
+struct TunedPhysics {
+    static constexpr float airResistance = 0.998f;  // share of the horizontal speed kept each tick
+    static constexpr float gravity = 0.02f;         // taken off the vertical speed each tick
+    static constexpr float bounce = 0.7f;           // share of the speed kept by a bounce
+};
+
+struct RuntimePhysics {
+    float airResistance, gravity, bounce;
+
+    RuntimePhysics ()
+        : airResistance(TunedPhysics::airResistance), gravity(TunedPhysics::gravity), bounce(TunedPhysics::bounce) {}
+
+    /* "air_resistance gravity bounce", false and unchanged if that isn't what 'text' holds */
+    bool parse (const char* text) {
+        float a, g, b;
+        if (!text || sscanf(text, "%f %f %f", &a, &g, &b) != 3)
+            return false;
+        airResistance = a;
+        gravity = g;
+        bounce = b;
+        return true;
+    }
+};
+
+/* Drag and gravity on a body in flight */
+template <typename Physics>
+inline void applyForces (const Physics& physics, float& vx, float& vy)
+{
+    vx *= physics.airResistance;
+    vy -= physics.gravity;
+}
+
+/* Below the ground, the vertical speed turns back up */
+template <typename Physics>
+inline void bounceOffGround (const Physics& physics, float y, float ground, float& vy)
+{
+    if (y < ground)
+        vy = -vy * physics.bounce;
+}
+
+/* Off the side of a barrier, the horizontal speed turns back */
+template <typename Physics>
+inline void bounceOffWall (const Physics& physics, float& vx)
+{
+    vx = -vx * physics.bounce;
+}
+
+/* A barrier's box, grown by the shot's radius : the shot touches it when its centre is inside */
+struct ShotBarrier {
+    float left, right, bottom, top;
+};
+
+/* One tick of a shot in flight as the game traces it : drag and gravity, the ground, each
+   barrier it is inside, then the move */
+template <typename Physics>
+inline void stepShot (const Physics& physics, float& x, float& y, float& vx, float& vy,
+                      const ShotBarrier* barriers, size_t count, float ground, float dt)
+{
+    applyForces(physics, vx, vy);
+    bounceOffGround(physics, y, ground, vy);
+    for (size_t i = 0; i < count; i++)
+        if (x > barriers[i].left && x < barriers[i].right && y > barriers[i].bottom && y < barriers[i].top)
+            bounceOffWall(physics, vx);
+    x += vx * dt;
+    y += vy * dt;
+}
+
+#endif
@@ -0,0 +1,87 @@
+/* Precompiled texture cache, shared by the game and texconv.
+
+   One file per source image, holding every mip level ready for glTexImage2D or
+   glCompressedTexImage2D :
+
+     TexCacheHeader
+     TexCacheLevel[levels]
+     level data, each level starting on a TEXCACHE_ALIGN boundary
+
+   Rows are stored top row first, like the decoded PNGs. The source file's size and
+   modification time are recorded so a stale cache is ignored instead of used. */
+#ifndef TEXCACHE_H
+#define TEXCACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#define TEXCACHE_MAGIC 0x3158544d   // "MTX1"
+#define TEXCACHE_VERSION 1
+#define TEXCACHE_ALIGN 16
+#define TEXCACHE_MAX_LEVELS 16
+#define TEXCACHE_DIR "texcache"
+
+enum TexCacheFormat {
+    TEXCACHE_RGBA8 = 0,   // 4 bytes per pixel
+    TEXCACHE_BC1 = 1,     // DXT1, 8 bytes per 4x4 block, 1 bit alpha
+    TEXCACHE_BC3 = 2      // DXT5, 16 bytes per 4x4 block
+};
+
+struct TexCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format;
+    uint32_t width, height;
+    uint32_t levels;
+    uint64_t sourceSize;
+    uint64_t sourceTime;
+};
+
+struct TexCacheLevel {
+    uint32_t offset;      // from the start of the file
+    uint32_t size;
+    uint32_t width, height;
+};
+
+/* Cache file for an image : texcache/beach.png.mtx, directories folded into the name */
+inline std::string texCachePath (const char* source)
+{
+    std::string name = source;
+    for (size_t i = 0; i < name.size(); i++)
+        if (name[i] == '/')
+            name[i] = '_';
+    return std::string(TEXCACHE_DIR) + "/" + name + ".mtx";
+}
+
+/* Bytes taken by one level of the given format */
+inline uint32_t texCacheLevelSize (uint32_t format, uint32_t width, uint32_t height)
+{
+    if (format == TEXCACHE_RGBA8)
+        return 4 * width * height;
+    uint32_t blocks = ((width + 3) / 4) * ((height + 3) / 4);
+    return blocks * (format == TEXCACHE_BC1 ? 8 : 16);
+}
+
+/* Header and level table checked against the file size, so a truncated or foreign
+   file is rejected before anything reads past the end */
+inline bool texCacheValid (const void* data, size_t size)
+{
+    if (size < sizeof(TexCacheHeader))
+        return false;
+    const TexCacheHeader* header = (const TexCacheHeader*) data;
+    if (header->magic != TEXCACHE_MAGIC || header->version != TEXCACHE_VERSION || header->format > TEXCACHE_BC3
+        || header->levels == 0 || header->levels > TEXCACHE_MAX_LEVELS)
+        return false;
+    if (size < sizeof(TexCacheHeader) + header->levels * sizeof(TexCacheLevel))
+        return false;
+
+    const TexCacheLevel* levels = (const TexCacheLevel*) (header + 1);
+    for (uint32_t i = 0; i < header->levels; i++)
+        if (levels[i].size != texCacheLevelSize(header->format, levels[i].width, levels[i].height)
+            || (uint64_t) levels[i].offset + levels[i].size > size)
+            return false;
+    return true;
+}
+
+#endif
@@ -0,0 +1,284 @@
+/* texconv : bakes images into the texture cache read by the game (see texcache.h).
+
+   texconv [-rgba | -bc1 | -bc3] image.png ...
+
+   Each image is decoded once here, its mip chain is built with a box filter and the
+   levels are written out raw or BCn compressed, so the game can skip the PNG decode
+   and glGenerateMipmap at startup. */
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include <SOIL/SOIL.h>
+
+#include "texcache.h"
+
+using namespace std;
+
+/**************************
+ * Mip chain              *
+ **************************/
+
+struct Image {
+    uint32_t width, height;
+    vector<unsigned char> pixels;   // RGBA, top row first
+};
+
+/* Half size image, each pixel the average of the 2x2 (or fewer, at odd edges) below it */
+Image downsample (const Image& src)
+{
+    Image dst;
+    dst.width = max(1u, src.width / 2);
+    dst.height = max(1u, src.height / 2);
+    dst.pixels.resize(4 * dst.width * dst.height);
+
+    for (uint32_t y = 0; y < dst.height; y++)
+        for (uint32_t x = 0; x < dst.width; x++) {
+            uint32_t x0 = min(2*x, src.width - 1), x1 = min(2*x + 1, src.width - 1);
+            uint32_t y0 = min(2*y, src.height - 1), y1 = min(2*y + 1, src.height - 1);
+            for (int c = 0; c < 4; c++) {
+                int sum = src.pixels[4*(y0*src.width + x0) + c] + src.pixels[4*(y0*src.width + x1) + c]
+                        + src.pixels[4*(y1*src.width + x0) + c] + src.pixels[4*(y1*src.width + x1) + c];
+                dst.pixels[4*(y*dst.width + x) + c] = (sum + 2) / 4;
+            }
+        }
+    return dst;
+}
+
+/**************************
+ * BCn encoding           *
+ **************************/
+
+/* Plain bounding box encoder : endpoints from the block's colour range, each pixel
+   snapped to the nearest palette entry. Quick, and good enough for scenery */
+
+uint16_t packColour (const unsigned char* c)
+{
+    return ((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3);
+}
+
+void unpackColour (uint16_t v, int* c)
+{
+    c[0] = ((v >> 11) & 31) * 255 / 31;
+    c[1] = ((v >> 5) & 63) * 255 / 63;
+    c[2] = (v & 31) * 255 / 31;
+}
+
+/* 4x4 block starting at (bx, by), edge pixels repeated for partial blocks */
+void fetchBlock (const Image& image, uint32_t bx, uint32_t by, unsigned char* block)
+{
+    for (int y = 0; y < 4; y++)
+        for (int x = 0; x < 4; x++) {
+            uint32_t sx = min(bx + x, image.width - 1), sy = min(by + y, image.height - 1);
+            memcpy(block + 4*(4*y + x), &image.pixels[4*(sy*image.width + sx)], 4);
+        }
+}
+
+/* 8 byte colour block. With punchThrough, pixels under half alpha become transparent (BC1 only) */
+void encodeColourBlock (const unsigned char* block, bool punchThrough, unsigned char* out)
+{
+    unsigned char lo[4] = { 255, 255, 255, 0 }, hi[4] = { 0, 0, 0, 0 };
+    bool transparent = false;
+    for (int i = 0; i < 16; i++) {
+        if (punchThrough && block[4*i + 3] < 128) {
+            transparent = true;
+            continue;
+        }
+        for (int c = 0; c < 3; c++) {
+            lo[c] = min(lo[c], block[4*i + c]);
+            hi[c] = max(hi[c], block[4*i + c]);
+        }
+    }
+
+    uint16_t c0 = packColour(hi), c1 = packColour(lo);
+    // c0 > c1 selects four colours, c0 <= c1 three colours and transparent black
+    if (transparent ? c0 > c1 : c0 < c1)
+        swap(c0, c1);
+
+    int palette[4][3];
+    unpackColour(c0, palette[0]);
+    unpackColour(c1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+        if (c0 > c1) {
+            palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+        }
+        else {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    }
+    int entries = c0 > c1 ? 4 : 3;
+
+    uint32_t indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0;
+        if (transparent && block[4*i + 3] < 128)
+            best = 3;
+        else if (c0 != c1) {
+            int bestDistance = 1 << 30;
+            for (int p = 0; p < entries; p++) {
+                int distance = 0;
+                for (int c = 0; c < 3; c++)
+                    distance += (block[4*i + c] - palette[p][c]) * (block[4*i + c] - palette[p][c]);
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    best = p;
+                }
+            }
+        }
+        indices |= best << (2*i);
+    }
+
+    out[0] = c0 & 255; out[1] = c0 >> 8;
+    out[2] = c1 & 255; out[3] = c1 >> 8;
+    memcpy(out + 4, &indices, 4);
+}
+
+/* 8 byte BC3 alpha block, eight interpolated levels between the block's extremes */
+void encodeAlphaBlock (const unsigned char* block, unsigned char* out)
+{
+    int a0 = 0, a1 = 255;
+    for (int i = 0; i < 16; i++) {
+        a0 = max(a0, (int) block[4*i + 3]);
+        a1 = min(a1, (int) block[4*i + 3]);
+    }
+
+    // Codes 0 and 1 are the endpoints, 2..7 step from a0 towards a1
+    uint64_t indices = 0;
+    for (int i = 0; i < 16 && a0 > a1; i++) {
+        int step = ((a0 - block[4*i + 3]) * 7 + (a0 - a1) / 2) / (a0 - a1);
+        uint64_t code = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+        indices |= code << (3*i);
+    }
+
+    out[0] = a0;
+    out[1] = a1;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (indices >> (8*i)) & 255;
+}
+
+vector<unsigned char> encodeLevel (const Image& image, uint32_t format)
+{
+    if (format == TEXCACHE_RGBA8)
+        return image.pixels;
+
+    vector<unsigned char> out (texCacheLevelSize(format, image.width, image.height));
+    unsigned char block[64], *next = &out[0];
+    for (uint32_t by = 0; by < image.height; by += 4)
+        for (uint32_t bx = 0; bx < image.width; bx += 4) {
+            fetchBlock(image, bx, by, block);
+            if (format == TEXCACHE_BC3) {
+                encodeAlphaBlock(block, next);
+                next += 8;
+            }
+            encodeColourBlock(block, format == TEXCACHE_BC1, next);
+            next += 8;
+        }
+    return out;
+}
+
+/**************************
+ * Cache files            *
+ **************************/
+
+bool convert (const char* filename, uint32_t format)
+{
+    struct stat source;
+    if (stat(filename, &source) != 0) {
+        fprintf(stderr, "%s: not found\n", filename);
+        return false;
+    }
+
+    int width, height;
+    unsigned char* pixels = SOIL_load_image(filename, &width, &height, 0, SOIL_LOAD_RGBA);
+    if (!pixels) {
+        fprintf(stderr, "%s: %s\n", filename, SOIL_last_result());
+        return false;
+    }
+
+    vector<Image> chain (1);
+    chain[0].width = width;
+    chain[0].height = height;
+    chain[0].pixels.assign(pixels, pixels + 4*width*height);
+    SOIL_free_image_data(pixels);
+    while ((chain.back().width > 1 || chain.back().height > 1) && chain.size() < TEXCACHE_MAX_LEVELS)
+        chain.push_back(downsample(chain.back()));
+
+    TexCacheHeader header;
+    header.magic = TEXCACHE_MAGIC;
+    header.version = TEXCACHE_VERSION;
+    header.format = format;
+    header.width = width;
+    header.height = height;
+    header.levels = chain.size();
+    header.sourceSize = source.st_size;
+    header.sourceTime = source.st_mtime;
+
+    vector<TexCacheLevel> levels (chain.size());
+    vector<vector<unsigned char> > data (chain.size());
+    uint32_t offset = sizeof(header) + levels.size() * sizeof(TexCacheLevel);
+    for (size_t i = 0; i < chain.size(); i++) {
+        data[i] = encodeLevel(chain[i], format);
+        offset = (offset + TEXCACHE_ALIGN - 1) & ~(TEXCACHE_ALIGN - 1);
+        levels[i].offset = offset;
+        levels[i].size = data[i].size();
+        levels[i].width = chain[i].width;
+        levels[i].height = chain[i].height;
+        offset += levels[i].size;
+    }
+
+    // Written beside the target and renamed over it, so the game never maps half a file
+    string path = texCachePath(filename), temp = path + ".tmp";
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (!out) {
+        perror(temp.c_str());
+        return false;
+    }
+    static const unsigned char zeros[TEXCACHE_ALIGN] = { 0 };
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(&levels[0], sizeof(TexCacheLevel), levels.size(), out);
+    for (size_t i = 0; i < chain.size(); i++) {
+        fwrite(zeros, 1, levels[i].offset - ftell(out), out);
+        fwrite(&data[i][0], 1, data[i].size(), out);
+    }
+    bool written = ferror(out) == 0;
+    written = fclose(out) == 0 && written;
+    if (!written || rename(temp.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "%s: could not write %s\n", filename, path.c_str());
+        remove(temp.c_str());
+        return false;
+    }
+
+    printf("%s -> %s : %dx%d, %d levels, %u bytes\n", filename, path.c_str(), width, height, (int) chain.size(), offset);
+    return true;
+}
+
+int main (int argc, char** argv)
+{
+    uint32_t format = TEXCACHE_RGBA8;
+    int failed = 0, images = 0;
+    mkdir(TEXCACHE_DIR, 0755);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-rgba") == 0)
+            format = TEXCACHE_RGBA8;
+        else if (strcmp(argv[i], "-bc1") == 0)
+            format = TEXCACHE_BC1;
+        else if (strcmp(argv[i], "-bc3") == 0)
+            format = TEXCACHE_BC3;
+        else {
+            images++;
+            failed += !convert(argv[i], format);
+        }
+    }
+
+    if (images == 0) {
+        fprintf(stderr, "usage: %s [-rgba | -bc1 | -bc3] image ...\n", argv[0]);
+        return 2;
+    }
+    return failed ? 1 : 0;
+}